@@ -1,744 +1,4009 @@
-
-#include <stdio.h>
-#include <unistd.h> 
-#include <fcntl.h>
-#include <stdlib.h>
-#include <string.h>
-#include <errno.h>
-
-#define message_t           short
-
-// programs
-void    computer_system    (int pipe_cpu_bus[],  int pipe_bus_cpu[], int length);
-void    system_bus         (int pipe_cpu_bus[],  int pipe_bus_cpu[], char *filename);
-void    io_device          (int pipe_io_bus[],   int pipe_bus_io[],  char *filename);
-void    transfer_device    (int pipe_tran_bus[], int pipe_bus_trans[]);
-void    buffer             (int pipe_buf_bus[],  int pipe_bus_buf[]);
-
-// piping utilities
-message_t       receive_from_pipe   (int p1[], int p2[]);
-
-// message utilities
-message_t       create_message      (int is, int cd, int halt, int id, int data);
-message_t       convert_to_message  (unsigned char buf[2]);
-void            write_message       (int pipe[], message_t msg);
-void            print_message       (message_t msg);
-unsigned char   get_control         (message_t msg);
-unsigned char   get_data            (message_t msg);
-int             get_id              (message_t msg);
-int             check_interrupt     (message_t msg);
-int             check_carry_data    (message_t msg);
-int             check_halt          (message_t msg);
-
-#define MSGSIZE 2
-
-#define CPU_ID              0
-#define BUS_ID              1
-#define IO_DEVICE_ID        2
-#define TRANSFER_DEVICE_ID  3
-#define BUFFER_ID           4
-
-#define MODE_READ           0
-#define MODE_WRITE          1
-
-#define STATE_MODE          0
-#define STATE_ADDRESS       1
-#define STATE_DATA          2
-
-int 
-main (int argc, char **argv) {
-    // a pipe from cpu to bus, 
-    // use 1 within cpu to write to bus
-    // use 0 within bus to read from cpu
-    int pipe_cpu_bus[2];
-    // a pipe from bus to cpu, 
-    // use 1 within bus to write to cpu 
-    // use 0 within cpu to read from bus
-    int pipe_bus_cpu[2];
-  
-    // error checking for pipe 
-    if (pipe(pipe_cpu_bus) < 0) 
-        exit(1); 
-    if (pipe(pipe_bus_cpu) < 0) 
-        exit(1);
-  
-    // Set the pipe to non-blocking
-    if (fcntl(pipe_cpu_bus[0], F_SETFL, O_NONBLOCK) < 0) 
-        exit(2); 
-    if (fcntl(pipe_bus_cpu[0], F_SETFL, O_NONBLOCK) < 0) 
-        exit(2); 
-  
-    switch (fork()) { 
-        // error 
-        case -1: 
-            exit(3); 
-    
-        // child process (COMPUTER SYSTEM)
-        case 0: 
-            if (argc >= 3) {
-                int length = atoi(argv[2]);
-                computer_system(pipe_cpu_bus, pipe_bus_cpu, length);
-            }
-            else {
-                printf("Usage: %s <file_name> <number>", argv[0]);
-            }
-            break; 
-    
-        // parent process (SYSTEM BUS)
-        default: 
-            if (argc >= 3) {
-                char* filename = argv[1];
-                system_bus(pipe_cpu_bus, pipe_bus_cpu, filename);
-            }
-            else {
-                printf("Usage: %s <file_name> <number>", argv[0]);
-            }
-            break; 
-    } 
-
-    return 0; 
-}
-
-void
-computer_system (int pipe_cpu_bus[], int pipe_bus_cpu[], int length) {
-    message_t msg;
-
-    msg = create_message(0, 1, 0, TRANSFER_DEVICE_ID, (length & 0b1111111100000000) >> 8);
-    write_message(pipe_cpu_bus, msg);
-
-    msg1 = create_message(0, 1, 0, TRANSFER_DEVICE_ID, length & 0b11111111);
-    write_message(pipe_cpu_bus, msg);
-
-    close(pipe_cpu_bus[0]); // close read end of cpu_bus
-    close(pipe_bus_cpu[1]); // close write end of bus_cpu
-
-    char buffer[10000] = {0};
-    int index = 0;
-
-    while (1) {
-        msg = receive_from_pipe(pipe_bus_cpu, pipe_cpu_bus);
-        if (msg != 0) {
-            if (get_id(msg) == CPU_ID) {
-                if (check_interrupt(msg)) {
-                    // the data has been fully stored in buffer
-                    if (get_data(msg) == 1) {
-                        // get the data from buffer and print it
-                        for (int i = 0; i < 128; i++) {
-                            msg = create_message(0, 1, 0, BUFFER_ID, MODE_READ);
-                            write_message(pipe_cpu_bus, msg);
-
-                            msg = create_message(0, 1, 0, BUFFER_ID, i);
-                            write_message(pipe_cpu_bus, msg);
-                        }
-
-                        while (1) {
-                            msg = receive_from_pipe(pipe_bus_cpu, pipe_cpu_bus);
-                            if (msg != 0) {
-                                if (get_id(msg) == CPU_ID) {
-                                    if (check_interrupt(msg)) {
-                                        if (get_data(msg) == 33) {
-                                            break;
-                                        }
-                                    }
-                                    else {
-                                        buffer[index++] = get_data(msg);
-                                    }
-                                }
-                            }
-                        }
-                        
-                        // acknowledge the transfer device so that it can
-                        // resume sending bytes to buffer
-                        msg = create_message(1, 1, 0, TRANSFER_DEVICE_ID, 0);
-                        write_message(pipe_cpu_bus, msg);
-                    }
-                    else if (get_data(msg) == 2) {
-                        printf("%s", buffer);
-                        memset(buffer, 0, sizeof buffer);
-
-                        // send halt to all devices
-                        msg = create_message(0, 0, 1, BUS_ID, 0);
-                        write_message(pipe_cpu_bus, msg);
-
-                        exit(0);
-                    }
-                }
-            }
-        }
-    }
-
-    exit(0);
-}
-
-void
-system_bus (int pipe_cpu_bus[], int pipe_bus_cpu[], char *filename) {
-
-    // ======== CREATE IO DEVICE PROCESS ========
-
-    int pipe_io_bus[2];
-    int pipe_bus_io[2];
-  
-    // error checking for pipe 
-    if (pipe(pipe_io_bus) < 0) 
-        exit(1); 
-    if (pipe(pipe_bus_io) < 0) 
-        exit(1);
-  
-    // Set the pipe to non-blocking
-    if (fcntl(pipe_io_bus[0], F_SETFL, O_NONBLOCK) < 0) 
-        exit(2); 
-    if (fcntl(pipe_bus_io[0], F_SETFL, O_NONBLOCK) < 0) 
-        exit(2); 
-  
-    switch (fork()) { 
-        // error 
-        case -1: 
-            exit(3); 
-    
-        // child process (IO DEVICE)
-        case 0: 
-            io_device(pipe_io_bus, pipe_bus_io, filename);
-            return; // end the child process (io device)
-            break; 
-
-        default:
-            break;
-    } 
-    // ======== CREATE TRANFER DEVICE PROCESS ========
-
-    int pipe_tran_bus[2];
-    int pipe_bus_tran[2];
-  
-    // error checking for pipe 
-    if (pipe(pipe_tran_bus) < 0) 
-        exit(1); 
-    if (pipe(pipe_bus_tran) < 0) 
-        exit(1);
-  
-    // Set the pipe to non-blocking
-    if (fcntl(pipe_tran_bus[0], F_SETFL, O_NONBLOCK) < 0) 
-        exit(2); 
-    if (fcntl(pipe_bus_tran[0], F_SETFL, O_NONBLOCK) < 0) 
-        exit(2); 
-  
-    switch (fork()) { 
-        // error 
-        case -1: 
-            exit(3); 
-    
-        // child process (TRANSFER DEVICE)
-        case 0: 
-            transfer_device(pipe_tran_bus, pipe_bus_tran);
-            return; // end the child process (transfer device)
-            break; 
-
-        default:
-            break;
-    } 
-    // ======== CREATE BUFFER PROCESS ========
-    int pipe_buf_bus[2];
-    int pipe_bus_buf[2];
-  
-    // error checking for pipe 
-    if (pipe(pipe_buf_bus) < 0) 
-        exit(1); 
-    if (pipe(pipe_bus_buf) < 0) 
-        exit(1);
-  
-    // Set the pipe to non-blocking
-    if (fcntl(pipe_buf_bus[0], F_SETFL, O_NONBLOCK) < 0) 
-        exit(2); 
-    if (fcntl(pipe_bus_buf[0], F_SETFL, O_NONBLOCK) < 0) 
-        exit(2); 
-  
-    switch (fork()) { 
-        // error 
-        case -1: 
-            exit(3); 
-    
-        // child process (BUFFER)
-        case 0: 
-            buffer(pipe_buf_bus, pipe_bus_buf);
-            return; // end the child process (buffer)
-            break; 
-
-        default:
-            break;
-    }
-    // =======================================
-
-    close(pipe_cpu_bus[1]); // close write end of cpu_bus
-    close(pipe_bus_cpu[0]); // close read end of bus_cpu
-
-    close(pipe_io_bus[1]);  // close write end of io_bus
-    close(pipe_bus_io[0]);  // close read end of bus_io
-
-    close(pipe_tran_bus[1]); // close write end of tran_bus
-    close(pipe_bus_tran[0]); // close read end of bus_tran
-
-    close(pipe_buf_bus[1]);  // close write end of buf_bus
-    close(pipe_bus_buf[0]);  // close read end of bus_buf
-
-    message_t msg = 0;
-
-    // receive a message from each device and 
-    // broadcast it to all other devices. 
-    while (1) {
-        msg = receive_from_pipe(pipe_cpu_bus, pipe_bus_cpu);
-        if (msg != 0) {
-            if (check_halt(msg)) {
-                message_t msg_halt1 = create_message(0, 0, 1, IO_DEVICE_ID, 0);
-                write_message(pipe_bus_io, msg_halt1);
-                message_t msg_halt2 = create_message(0, 0, 1, TRANSFER_DEVICE_ID, 0);
-                write_message(pipe_bus_tran, msg_halt2);
-                message_t msg_halt3 = create_message(0, 0, 1, BUFFER_ID, 0);
-                write_message(pipe_bus_buf, msg_halt3);
-                exit(0);
-            }
-
-            // broadcast the msg to all devices
-            write_message(pipe_bus_cpu, msg);
-            write_message(pipe_bus_io, msg);
-            write_message(pipe_bus_tran, msg);
-            write_message(pipe_bus_buf, msg);
-        }
-        
-        msg = receive_from_pipe(pipe_io_bus, pipe_bus_io);
-        if (msg != 0) {
-            // broadcast the msg to all devices
-            write_message(pipe_bus_cpu, msg);
-            write_message(pipe_bus_io, msg);
-            write_message(pipe_bus_tran, msg);
-            write_message(pipe_bus_buf, msg);
-        }
-
-        msg = receive_from_pipe(pipe_tran_bus, pipe_bus_tran);
-        if (msg != 0) {
-            // broadcast the msg to all devices
-            write_message(pipe_bus_cpu, msg);
-            write_message(pipe_bus_io, msg);
-            write_message(pipe_bus_tran, msg);
-            write_message(pipe_bus_buf, msg); 
-        }
-
-        msg = receive_from_pipe(pipe_buf_bus, pipe_bus_buf);
-        if (msg != 0) {
-            // broadcast the msg to all devices
-            write_message(pipe_bus_cpu, msg);
-            write_message(pipe_bus_io, msg);
-            write_message(pipe_bus_tran, msg);
-            write_message(pipe_bus_buf, msg);
-        }
-    }
-}
-
-void 
-io_device (int pipe_io_bus[], int pipe_bus_io[], char *filename) {
-    char byte;
-    int wait_time;
-    FILE *fp;
-
-    int waiting = 0;
-    int reading_line = 0;
-
-    message_t msg = 0;
-
-    close(pipe_io_bus[0]); // close read end of bus_io
-    close(pipe_bus_io[1]); // close write end of io_bus
-
-    fp = fopen(filename, "r");
-
-    while (1) {
-        if (!waiting) {
-            byte = fgetc(fp);
-            
-            if (byte == -1) { // EOF
-                exit(0);
-            }
-
-            if (!reading_line) {
-                switch (byte) {
-                    case 't':
-                        byte = fgetc(fp); // skip space
-                        reading_line = 1;
-                        break;
-
-                    case 'n':
-                        byte = '\n';
-                        waiting = 1;
-
-                        char throw_away = fgetc(fp); // advance to char after newline
-                        break;
-
-                    case 'd':
-                        fscanf(fp, " %d", &wait_time);
-                        usleep(wait_time * 1000);
-
-                        byte = fgetc(fp); // advance to char after newline
-                        break;
-                }
-            }
-            // read a char until newline is reached, once the char is read, 
-            // wait for it to be sent to transfer device, then resume.
-            else {
-                if (byte == '\n') {
-                    reading_line = 0;
-                }
-                else {
-                    waiting = 1;
-                }
-            }
-        }
-
-        msg = receive_from_pipe(pipe_bus_io, pipe_io_bus);
-
-        if (msg != 0) {
-            if (get_id(msg) == IO_DEVICE_ID) {
-                if (check_halt(msg)) {
-                    exit(0);
-                }
-                if (get_data(msg) == 1) { 
-                    // write character to transfer device
-                    message_t msg1 = create_message(0, 1, 0, TRANSFER_DEVICE_ID, byte);
-                    write_message(pipe_io_bus, msg1);
-
-                    waiting = 0;
-                }
-            }
-        }
-    }
-}
-
-//  protocol for communication between transfer device and IO device:
-//  transfer sends IO a msg 
-//  if data == 1
-//      then the IO should send back the next character 
-//      via a msg with that character as the data
-
-void 
-transfer_device (int pipe_tran_bus[], int pipe_bus_tran[]) {
-    int MAX_LENGTH = 128;
-
-    message_t msg = 0;
-    int length_has_been_read = 0;
-    int length = 0;
-    int index = 0;
-
-    close(pipe_tran_bus[0]); // close read end of bus_io
-    close(pipe_bus_tran[1]); // close write end of io_bus
-
-    while (1) {
-        msg = receive_from_pipe(pipe_bus_tran, pipe_tran_bus);
-
-        if (msg != 0) {   
-            if (get_id(msg) == TRANSFER_DEVICE_ID) {
-                if (check_halt(msg)) {
-                    exit(0);
-                }
-
-                // read the length passed by 2 messages
-                if (length_has_been_read < 2) {
-                    if (length_has_been_read == 0) {
-                        length = get_data(msg) << 8;
-                    }
-                    else if (length_has_been_read == 1) {
-                        int len = get_data(msg);
-                        length += len;
-                    
-                        // tell the IO device to start sending a msg containing 
-                        // a character to the transfer device
-                        message_t msg1 = create_message(0, 1, 0, IO_DEVICE_ID, 1);
-                        write_message(pipe_tran_bus, msg1);
-                    }
-
-                    length_has_been_read++;
-                } 
-                else {
-                    char character = get_data(msg);
-
-                    // send a chain of messages to the buffer to 
-                    // store 'character' at address 'index'
-                    message_t msg1 = create_message(0, 1, 0, BUFFER_ID, MODE_WRITE);
-                    write_message(pipe_tran_bus, msg1);
-
-                    message_t msg2 = create_message(0, 1, 0, BUFFER_ID, index);
-                    write_message(pipe_tran_bus, msg2);
-
-                    message_t msg3 = create_message(0, 1, 0, BUFFER_ID, character);
-                    write_message(pipe_tran_bus, msg3);
-
-                    // if the number of letters send to buffer is == 128,
-                    // tell the CPU to read from the BUFFER, the come back
-                    index++;
-                    if (index == MAX_LENGTH) {
-                        message_t msg6 = create_message(1, 1, 0, CPU_ID, 1);
-                        write_message(pipe_tran_bus, msg6);
-
-                        
-                        // wait for acknowledge from CPU
-                        while (1) {
-                            msg = receive_from_pipe(pipe_bus_tran, pipe_tran_bus);
-                            if (msg != 0) {
-                                if (get_id(msg) == TRANSFER_DEVICE_ID) {
-                                    if (check_interrupt(msg)) {
-                                        break;
-                                    }
-                                }
-                            }
-                        }
-                        
-                        length = length - MAX_LENGTH;
-                        index = 0;
-                    }
-                    // while there is still stuff in the IO, grab the next character
-                    if (index < length) {
-                        message_t msg4 = create_message(0, 1, 0, IO_DEVICE_ID, 1);
-                        write_message(pipe_tran_bus, msg4);
-                    }
-                    else {
-                        message_t msg6 = create_message(1, 1, 0, CPU_ID, 1);
-                        write_message(pipe_tran_bus, msg6);
-
-                        while (1) {
-                            msg = receive_from_pipe(pipe_bus_tran, pipe_tran_bus);
-                            if (msg != 0) {
-                                if (get_id(msg) == TRANSFER_DEVICE_ID) {
-                                    if (check_interrupt(msg)) {
-                                        break;
-                                    }
-                                }
-                            }
-                        }
-
-                        // send the CPU a message telling it the data 
-                        // has been read to buffer
-                        message_t msg5 = create_message(1, 1, 0, CPU_ID, 2);
-                        write_message(pipe_tran_bus, msg5);
-                    }
-                }
-            }
-        }
-    }
-}
-
-void 
-buffer (int pipe_buf_bus[], int pipe_bus_buf[]) {
-    message_t msg = 0;
-
-    close(pipe_buf_bus[0]); // close read end of bus_io
-    close(pipe_bus_buf[1]); // close write end of io_bus
-
-    char buf[128] = {0};
-
-    int mode = -1;
-    int address = 0;
-    int data = 0;
-
-    int curr_state = STATE_MODE;
-
-    while (1) {
-        msg = receive_from_pipe(pipe_bus_buf, pipe_buf_bus);
-
-        if (msg != 0) {
-            if (get_id(msg) == BUFFER_ID) {
-                if (check_halt(msg)) {
-                    //printf("==== BUFFER HAS HALTED ====\n");
-                    exit(0);
-                }
-                if (curr_state == STATE_MODE) {
-                    mode = get_data(msg);
-
-                    curr_state = STATE_ADDRESS;
-                }
-                else if (curr_state == STATE_ADDRESS) {
-                    address = get_data(msg);
-
-                    if (mode == MODE_WRITE) {
-                        curr_state = STATE_DATA;
-                    }
-                    else if (mode == MODE_READ) {
-                        data = buf[address];
-
-                        //printf("============ BUFFER SENDING ['%c' @ %d] ============\n", data, address);
-                        message_t msg1 = create_message(0, 1, 0, CPU_ID, data);
-                        write_message(pipe_buf_bus, msg1);
-
-                        if (address == 127 || data == 0) {
-                            message_t msg9 = create_message(1, 1, 0, CPU_ID, 33);
-                            write_message(pipe_buf_bus, msg9);
-                            memset(buf, 0, sizeof buf);
-                        }
-
-                        mode = -1;
-                        address = 0;
-                        data = 0;
-
-                        curr_state = STATE_MODE;
-                    }
-                }
-                else if (curr_state == STATE_DATA) {
-                    data = get_data(msg);
-
-                    //printf("==== STORED ['%c'] IN BUFFER ====\n", data);
-                    buf[address] = data;
-                    mode = -1;
-                    address = 0;
-                    data = 0;
-
-                    curr_state = STATE_MODE;
-                }
-            }
-        }
-    }
-}
-
-message_t
-receive_from_pipe (int p1[], int p2[]) {
-    int nread;
-    unsigned char buf[MSGSIZE];
-
-    memset(buf, 0, sizeof buf);
-    nread = read(p1[0], buf, MSGSIZE);
-    switch (nread) {
-        // case -1 means pipe is empty and errno set EAGAIN
-        case -1:
-            if (errno == EAGAIN) {
-                //printf("  (pipe empty)\n");
-                break;
-            }
-            else {
-                perror("recieving message from pipe");
-                exit(4);
-            }
-
-        
-        // case 0 means that all the bytes have been read, 
-        // EOF has been reached
-        case 0:
-            close(p1[0]);
-            close(p2[1]);
-            exit(0);
-        
-
-        default:
-            return convert_to_message(buf);
-    }
-
-    return 0;
-}
-
-
-// A message is comprised of the following:
-// bit  | description
-// ========================================
-// 0    | interrupt signal
-// 1    | carrying data
-// 2    | halt?
-// 3-7  | ID of device to receive message
-// 8-15 | data
-//
-// ID # | device
-// ===================
-//   0  | CPU
-//   1  | Bus
-//   2  | IO
-//   3  | Transfer 
-//   4  | Buffer
-message_t
-create_message (int is, int cd, int halt, int id, int data) {
-    message_t message = 0;
-
-    if (is > 1 || is < 0) {
-        printf("Interrupt Signal Bit [%d] must range from 0 to 1", is);
-        exit(1);
-    }
-
-    if (cd > 1 || halt < 0) {
-        printf("Carry Data Bit [%d] must range from 0 to 1", cd);
-        exit(1);
-    }
-
-    if (halt > 1 || halt < 0) {
-        printf("Halt Bit must [%d] range form 0 to 1", halt);
-        exit(1);
-    }
-
-    if (id > 4 || id < 0) {
-        printf("ID must range [%d] from 0 to 4", id);
-        exit(1);
-    }
-
-    if (data > 255 || data < 0) {
-        printf("Data [%d] must range from 0 to 255.", data);
-        exit(1);
-    }
-
-    message += is << 15;
-    message += cd << 14;
-    message += halt << 13;
-    message += id << 8;
-    message += data << 0;
-
-    return message;
-}
-
-message_t
-convert_to_message (unsigned char buf[2]) {
-    message_t msg = 0;
-    msg += buf[0] << 8;
-    msg += buf[1];
-    return msg;
-}
-
-void
-write_message (int pipe[], message_t msg) {
-    unsigned char buf[MSGSIZE] = {(unsigned char) (msg >> 8), (unsigned char) msg};;
-    write(pipe[1], buf, MSGSIZE);
-}
-
-void
-print_message (message_t msg) {
-    int mask = 1 << 15;
-    for (int i = 15; i >= 0; i--, mask /= 2) {
-        if (msg & mask) 
-            printf("1");
-        else
-            printf("0");
-    }
-}
-
-unsigned char 
-get_control (message_t msg) {
-    message_t leftside = msg & 0b1111111100000000;
-    unsigned char c = leftside >> 8;
-    return c;
-}
-
-unsigned char 
-get_data (message_t msg) {
-    message_t leftside = msg & 0b0000000011111111;
-    unsigned char c = leftside;
-    return c;
-}
-
-int
-get_id (message_t msg) {
-    int id = msg >> 8;
-    id = id & 0b00011111;
-    return id;
-}
-
-int
-check_interrupt (message_t msg) {
-    return (msg & (1 << 15)) != 0;
-}
-
-int
-check_carry_data (message_t msg) {
-    return (msg & (1 << 14)) != 0;
-}
-
-int
-check_halt (message_t msg) {
-    return (msg & (1 << 13)) != 0;
+
+#define _GNU_SOURCE     // mremap and memfd_create
+#include <stdio.h>
+#include <unistd.h> 
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <dirent.h>
+#include <libgen.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#define message_t           unsigned int
+
+#define RING_SIZE           65536   // bytes, the same as the default pipe capacity
+#define FRAME_SIZE          1024    // bytes moved by one batched read or write
+#define KERNEL_MIN          64      // bytes copied before a page kernel beats a plain loop
+#define WINDOW_MAX          1024    // requests in flight; what they cause on a link
+                                    // (3 wide messages each) always fits in a ring or pipe,
+                                    // so the bus never waits on a device waiting on it
+
+// a futex word that the reader of one or more rings sleeps on
+typedef struct {
+    _Atomic unsigned int    seq;        // bumped after every write
+    _Atomic int             sleepers;
+} doorbell_t;
+
+// a single producer, single consumer byte ring living in shared memory.
+// head and tail only ever grow, and sit on separate cache lines so the
+// producer and the consumer do not bounce one line between them.
+typedef struct {
+    _Atomic unsigned int    head;       // next byte to read, owned by the consumer
+    char                    pad1[60];
+    _Atomic unsigned int    tail;       // next byte to write, owned by the producer
+    char                    pad2[60];
+    doorbell_t              bell;
+    doorbell_t             *wake;       // rung by the producer, usually &bell
+    unsigned char           data[RING_SIZE];
+} ring_t;
+
+// one direction of a link between the bus and a device. depending on
+// the transport it is either a pipe or a ring in shared memory.
+// with -b, messages written to it are queued in 'out' and sent as one
+// frame, and reads pull a whole frame into 'in' to hand out one by one.
+typedef struct {
+    int             pipe[2];
+    ring_t         *ring;
+
+    unsigned char   out[FRAME_SIZE];
+    int             out_length;
+    unsigned char   in[FRAME_SIZE];
+    int             in_start;
+    int             in_length;
+} channel_t;
+
+// the rings handed out by open_channel, per thread so that batch 
+// workers each run their own system
+__thread ring_t *ring_pool = NULL;
+__thread int     ring_pool_used = 0;
+__thread int     ring_pool_size = 0;
+
+// where the cpu streams the text as pages drain. with -s, pages are 
+// gathered in 'buf' until it fills, then go out with it in one writev.
+typedef struct {
+    int     fd;
+    char   *buf;
+    int     size;
+    int     length;
+} sink_t;
+
+// one directive of the io device's script, parsed before the first fork
+typedef struct {
+    int             type;       // OP_TEXT, OP_NEWLINE or OP_DELAY
+    int             length;     // bytes of text, or milliseconds of delay
+    const char     *text;       // points into the mapped file
+} op_t;
+
+typedef struct {
+    op_t   *ops;
+    int     count;
+    int     size;
+    long    chars;              // bytes the script sends in all
+    char   *file;               // the mapping, NULL when empty
+    size_t  file_size;
+} script_t;
+
+// filled in by the devices during a bench run, in memory shared with
+// the bench process. each field has a single writer.
+typedef struct {
+    long    messages;           // routed by the bus
+    long    simulated_ns;       // virtual time of all runs, with -V
+    int     pages;              // round trips held in rtt
+    int     capacity;
+    long    rtt[];              // ns from a page interrupt to its ack
+} stats_t;
+
+stats_t *stats = NULL;          // NULL outside of bench runs
+
+// counters each process keeps about itself, always on. every process
+// owns one slot of a shared array, indexed by its ID, on its own cache
+// line so that no two processes write the same line.
+typedef struct {
+    long    sent;               // messages written
+    long    received;           // messages read
+    long    bursts;             // burst frames written
+    long    empty_polls;        // reads that found the channel empty
+    long    blocks;             // sleeps waiting for a message, in a delay or at halt
+    long    blocked_ns;         // time spent in those sleeps
+    long    interrupts_raised;
+    long    interrupts_acked;
+    long    state_changes;      // buffer state machine
+    long    started_ns;
+    long    stopped_ns;
+} __attribute__((aligned(64))) counters_t;
+
+// a trace file starts with this header, so a replay runs with the 
+// same message format, pages and routing as the traced run
+typedef struct {
+    char    magic[8];           // "CPUTRACE"
+    int     version;            // 5
+    int     wide;
+    int     page_size;
+    int     banks;
+    int     burst;
+    int     routing;
+    int     stream;
+    int     zero_copy;          // bursts without payloads
+    int     channels;
+    int     window;
+    int     group;
+    int     unused;             // keeps the records 8 byte aligned
+} trace_header_t;
+
+// then one record per message the bus received, followed by the rest
+// of its burst frame when it starts one, padded to 8 bytes
+typedef struct {
+    long        time_ns;        // since the bus started
+    int         source;         // ID of the sender
+    message_t   msg;
+    int         tail_length;    // bytes of the burst frame after msg
+} trace_record_t;
+
+// the file is mapped and grown by doubling, so recording is a copy 
+// into memory and the kernel writes it back in its own time
+typedef struct {
+    int     fd;
+    char   *map;
+    size_t  size;
+    size_t  length;
+    long    start_ns;
+} trace_t;
+
+trace_t trace = { .fd = -1 };
+
+// the kernels that scan, copy and clear pages, picked once at start
+// for the cpu the simulation runs on
+typedef struct {
+    const char *name;
+    int       (*scan) (const char *page, int length);
+    void      (*copy) (void *to, const void *from, int length);
+    void      (*zero) (void *page, int length);
+} kernels_t;
+
+kernels_t kernels;
+
+// a work stealing deque of batch scripts, by index. it is filled 
+// before the workers start, so the owner only ever pops from the 
+// bottom and the others steal from the top.
+typedef struct {
+    _Atomic long    top;
+    char            pad1[56];
+    _Atomic long    bottom;
+    char            pad2[56];
+    int            *tasks;
+} deque_t;
+
+typedef struct {
+    pthread_t   thread;
+    deque_t     deque;
+    long        scripts;            // run by this worker
+    long        steals;             // of them, taken from another worker
+    long        simulated_ns;       // virtual time of its runs, with -V
+} worker_t;
+
+#define CHANNELS_MAX        9   // the IDs of the last channel end at 30, below BROADCAST_ID
+#define COUNTER_SLOTS       (2 + 3 * CHANNELS_MAX)  // cpu, bus, then io, transfer and buffer per channel
+
+// every page the cpu, the transfer device and the buffer work in, 
+// carved out of one mapping made before the first fork and passed 
+// around by index. nothing is allocated once the system is running,
+// and the footprint is fixed by -p, -B and -n.
+#define SLOT_CPU            0   // the page the cpu reads back into
+// then for each channel, the page its transfer device collects a burst
+// in, followed by one per bank: the buffer's banks, or with -z the pages
+// handed from device to device
+#define SLOT_TRANSFER(k)    (1 + (k) * (1 + config.banks))
+#define SLOT_BANK(k, b)     (SLOT_TRANSFER(k) + 1 + (b))
+typedef struct {
+    int     count;                      // slots
+    size_t  pages;                      // offset of the first slot, page aligned
+    int     free_count[CHANNELS_MAX];   // with -z, slots not handed out, per channel
+    int     free[];                     // channel k's at k * banks, most recently given back last
+} slab_t;
+
+__thread slab_t *slab = NULL;
+
+// what the bus and the devices allocate for one run. they end in
+// finish() and never return to free it, so in the engine, where many
+// runs share a thread, the run frees it all when it is over
+__thread void  **run_blocks = NULL;
+__thread int     run_block_count = 0;
+__thread int     run_block_size = 0;
+
+// the bus's interrupt controller. interrupts the devices raise for the
+// cpu are latched here and counted per vector, and the cpu hears of one
+// vector at a time, with its count: whatever else is raised before the
+// cpu's end of interrupt (EOI) collapses into the next delivery.
+typedef struct {
+    int     pending[4][CHANNELS_MAX];   // raised and not delivered, by 2 bit cause and channel
+    int     mask;                       // causes the cpu does not want, a bit each
+    int     in_service;                 // delivered, and no EOI yet
+    int     next;                       // the channel looked at first
+} intc_t;
+
+// the cpu's state between messages, for its interrupt handlers
+typedef struct {
+    channel_t  *cpu_bus;
+    sink_t      sinks[CHANNELS_MAX];
+    int         pending[CHANNELS_MAX];  // pages filled and not yet read back
+    int         done;                   // channels with every page read back
+} cpu_t;
+
+// how the bus (or main, for the cpu) starts each part of the system, 
+// in a process of its own or, with -m thread, in a thread
+typedef struct {
+    pthread_t   thread;
+    int         id;
+    counters_t *slot;           // taken on the starting thread, whose slots these are
+    slab_t     *slab;           // and whose slab this is
+    channel_t  *to_bus;
+    channel_t  *from_bus;
+    script_t   *script;
+    script_t  **scripts;        // for the bus, one per channel
+    int         length;
+    int        *output_fds;     // for the cpu's sinks, one per channel
+} device_t;
+
+// per thread, so that batch workers each run their own system
+__thread device_t devices[COUNTER_SLOTS];
+
+// with -m engine every part of the system is a coroutine on one
+// thread. a coroutine runs until it would sleep, then hands control
+// back to the scheduler, which resumes it once its channels have
+// something to read or its timer is due.
+#define COROUTINE_STACK     (256 * 1024)
+
+typedef struct {
+    ucontext_t      context;
+    void           *stack;
+    int             started;
+    int             done;
+    long            wake_at;        // on the engine's clock, 0 when not sleeping
+    channel_t     **wait_in;        // channels it sleeps on
+    int             wait_count;
+    ring_t         *wait_ring;      // a full ring it is writing to
+    unsigned int    wait_room;      // bytes it needs there
+    int             joining;        // the bus, waiting for the rest to finish
+    counters_t     *counters;
+} coroutine_t;
+
+typedef struct {
+    ucontext_t      scheduler;
+    coroutine_t     coroutines[COUNTER_SLOTS];  // indexed by ID
+    coroutine_t    *current;
+    int             live;
+    long            clock;          // virtual ns since the start, with -V
+} engine_t;
+
+__thread engine_t *engine = NULL;
+__thread long simulated_ns = 0;     // length of the last run on this thread
+
+__thread counters_t *slots = NULL;
+counters_t unused_counters;     // written to before a process has a slot
+__thread counters_t *counters = &unused_counters;
+
+#define TRANSPORT_PIPE      0
+#define TRANSPORT_RING      1
+
+#define WAIT_SPIN           0
+#define WAIT_BLOCK          1
+
+#define ROUTE_BROADCAST     0
+#define ROUTE_ADDRESSED     1
+
+#define MODE_PROCESS        0
+#define MODE_THREAD         1
+#define MODE_ENGINE         2
+
+#define DUMP_NONE           0
+#define DUMP_TABLE          1
+#define DUMP_JSON           2
+
+// options chosen on the command line, fixed before the first fork
+typedef struct {
+    int     mode;               // processes or threads
+    int     transport;
+    int     wait;
+    int     routing;
+    int     batch;
+    int     burst;
+    int     wide;
+    int     msg_size;           // bytes per message on the wire
+    int     data_max;           // largest value of the data field
+    int     page_size;          // bytes in the buffer, moved per interrupt
+    int     banks;              // pages the buffer holds at once
+    int     sink_size;          // bytes of output gathered per write
+    int     dump;               // how the counters are shown at halt
+    int     trace_fd;           // file the bus records messages to, or -1
+    int     workers;            // batch threads, 0 for one per core
+    int     virtual_time;       // delays move a clock instead of sleeping
+    int     stream;             // no length, the io device ends the text
+    int     zero_copy;          // text moves through the page pool
+    int     channels;           // io device, transfer device and buffer sets
+    char   *output_path;        // -o, one file per channel when there are more
+    int     window;             // requests a sender keeps outstanding on a link
+    int     prefetch;           // bytes the io device parses ahead of the requests
+    int     group;              // characters asked for in one request
+} config_t;
+
+config_t config = {
+    .mode = MODE_PROCESS,
+    .transport = TRANSPORT_PIPE,
+    .wait = WAIT_SPIN,
+    .routing = ROUTE_BROADCAST,
+    .batch = 0,
+    .burst = 0,
+    .wide = 0,
+    .msg_size = 2,
+    .data_max = 255,
+    .page_size = 128,
+    .banks = 1,
+    .sink_size = 0,
+    .dump = DUMP_NONE,
+    .trace_fd = -1,
+    .workers = 0,
+    .virtual_time = 0,
+    .stream = 0,
+    .zero_copy = 0,
+    .channels = 1,
+    .output_path = NULL,
+    .window = 16,
+    .prefetch = 64,
+    .group = 1,
+};
+
+// setup
+void    usage              (char *name);
+void    check_length       (int length);
+void    run_system         (script_t *scripts[], int length, int *output_fds);
+void    start_device       (int id, channel_t *to_bus, channel_t *from_bus, script_t *script, int length);
+void   *run_device         (void *arg);
+void    wait_for_devices   (void);
+void    finish             (void) __attribute__((noreturn));
+void    delay              (int ms);
+
+// engine utilities
+void    engine_start       (int id);
+void    engine_entry       (void);
+void    engine_run         (void);
+void    engine_yield       (void);
+void    engine_wait        (channel_t *in[], int count);
+void    engine_sleep       (long ns);
+void    engine_wait_room   (ring_t *ring, int count);
+int     engine_runnable    (coroutine_t *co, long *now);
+long    engine_now         (void);
+
+// programs
+void    computer_system    (channel_t *cpu_bus,  channel_t *bus_cpu,  int length, int *output_fds);
+void    system_bus         (channel_t *cpu_bus,  channel_t *bus_cpu,  script_t *scripts[]);
+void    io_device          (channel_t *io_bus,   channel_t *bus_io,   script_t *script, int channel);
+void    transfer_device    (channel_t *tran_bus, channel_t *bus_tran, int channel);
+void    buffer             (channel_t *buf_bus,  channel_t *bus_buf,  int channel);
+
+// script utilities
+void    load_script        (char *filename, script_t *script);
+void    parse_script       (const char *file, size_t size, script_t *script);
+void    unload_script      (script_t *script);
+void    add_op             (script_t *script, int type, int length, const char *text);
+int     fill_page          (script_t *script, int *op, int *position, char *page, int filled, int size);
+
+// bench utilities
+void    bench              (int argc, char **argv);
+char   *generate_script    (int lines, int line_length, int delay_min, int delay_max, size_t *size);
+long    now_ns             (void);
+void    record_rtt         (long ns);
+int     compare_long       (const void *a, const void *b);
+
+// counter utilities
+void    map_counters       (void);
+void    attach_counters    (counters_t *slot);
+void    stop_counters      (void);
+void    dump_counters      (void);
+
+// batch utilities
+void    batch              (int argc, char **argv);
+void    add_scripts        (char *path);
+void    add_path           (char *path);
+void   *batch_worker       (void *arg);
+int     deque_pop          (deque_t *deque);
+int     deque_steal        (deque_t *deque);
+int     compare_paths      (const void *a, const void *b);
+
+// trace utilities
+void    map_trace          (void);
+void    trace_message      (int source, message_t msg, unsigned char *tail, int tail_length);
+void    close_trace        (void);
+void    replay             (int argc, char **argv);
+int     delivered_to       (trace_record_t *record, int id);
+
+// bus utilities
+void    route_message      (channel_t *outbound[], int ids[], int count, int from, 
+                            message_t msg, unsigned char *frame, int frame_length);
+void    intc_accept        (intc_t *intc, message_t msg);
+void    intc_deliver       (intc_t *intc, channel_t *bus_cpu);
+
+// interrupt handlers, by cause
+void    cpu_page_full      (cpu_t *cpu, int channel, int count);
+void    cpu_done           (cpu_t *cpu, int channel, int count);
+void    cpu_spurious       (cpu_t *cpu, int channel, int count);
+
+// channel utilities
+void            map_rings           (int count);
+void            open_channel        (channel_t *ch);
+void            close_read_end      (channel_t *ch);
+void            close_write_end     (channel_t *ch);
+void            share_doorbell      (channel_t *ch, channel_t *with);
+int             ring_read           (ring_t *ring, unsigned char *buf, int least, int most);
+void            ring_write          (ring_t *ring, unsigned char *buf, int count);
+int             read_channel        (channel_t *in, channel_t *out, unsigned char *buf, int least, int most);
+void            write_channel       (channel_t *ch, unsigned char *buf, int count);
+void            write_bytes         (channel_t *ch, unsigned char *buf, int count);
+void            flush_channel       (channel_t *ch);
+void            wait_for_channels   (channel_t *in[], int count, int epoll_fd);
+message_t       receive_message     (channel_t *in, channel_t *out);
+message_t       await_message       (channel_t *in, channel_t *out);
+void            receive_bytes       (channel_t *in, channel_t *out, unsigned char *buf, int count);
+
+// sink utilities
+void            open_sink           (sink_t *sink, int fd);
+void            sink_write          (sink_t *sink, char *data, int count);
+void            flush_sink          (sink_t *sink);
+void            write_all           (int fd, struct iovec *iov, int count);
+
+// burst utilities
+void            write_burst         (channel_t *ch, int id, int mode, int address, int length, unsigned char *payload);
+int             receive_descriptor  (channel_t *in, channel_t *out, int *address);
+int             receive_frame       (channel_t *in, channel_t *out, message_t header, unsigned char *frame);
+int             burst_has_payload   (int mode);
+
+// device utilities
+int             request_text        (channel_t *tran_bus, int channel, int want);
+void            read_byte           (channel_t *cpu_bus, int channel, int address);
+void            await_halt          (channel_t *in, channel_t *out) __attribute__((noreturn));
+
+// slab utilities
+void            map_slab            (void);
+void            unmap_slab          (void);
+char           *slab_page           (int slot);
+void           *run_alloc           (size_t size);
+void            free_run            (void);
+int             slab_take           (int channel);
+void            slab_give           (int channel, int slot);
+
+// page utilities
+void            pick_kernels        (void);
+int             scan_scalar         (const char *page, int length);
+void            copy_scalar         (void *to, const void *from, int length);
+void            zero_scalar         (void *page, int length);
+#if defined(__x86_64__) || defined(__i386__)
+int             scan_sse2           (const char *page, int length) __attribute__((target("sse2")));
+void            copy_sse2           (void *to, const void *from, int length) __attribute__((target("sse2")));
+void            zero_sse2           (void *page, int length) __attribute__((target("sse2")));
+int             scan_avx2           (const char *page, int length) __attribute__((target("avx2")));
+void            copy_avx2           (void *to, const void *from, int length) __attribute__((target("avx2")));
+void            zero_avx2           (void *page, int length) __attribute__((target("avx2")));
+#endif
+
+// message utilities
+message_t       create_message      (int is, int cd, int halt, int id, int data);
+message_t       convert_to_message  (unsigned char buf[]);
+void            convert_to_bytes    (message_t msg, unsigned char buf[]);
+void            write_message       (channel_t *ch, message_t msg);
+void            print_message       (message_t msg);
+unsigned char   get_control         (message_t msg);
+unsigned int    get_data            (message_t msg);
+int             get_id              (message_t msg);
+int             addressed_to        (message_t msg, int id);
+int             check_interrupt     (message_t msg);
+int             check_carry_data    (message_t msg);
+int             check_halt          (message_t msg);
+int             check_burst         (message_t msg);
+void            classify            (unsigned char classes[256], int id);
+void            classify_bus        (unsigned char classes[256]);
+
+#define MSGSIZE_MAX 4   // bytes in a wide message
+
+#define CPU_ID              0
+#define BUS_ID              1
+#define IO_DEVICE_ID        2
+#define TRANSFER_DEVICE_ID  3
+#define BUFFER_ID           4
+#define BROADCAST_ID        31  // every device except the sender
+
+// channel k has its io device, transfer device and buffer at 2 + 3k,
+// 3 + 3k and 4 + 3k, so channel 0 keeps the IDs above
+#define CHANNEL_IO(k)       (IO_DEVICE_ID + 3 * (k))
+#define CHANNEL_TRANSFER(k) (TRANSFER_DEVICE_ID + 3 * (k))
+#define CHANNEL_BUFFER(k)   (BUFFER_ID + 3 * (k))
+#define CHANNEL_OF(id)      (((id) - IO_DEVICE_ID) / 3)
+#define KIND_OF(id)         (IO_DEVICE_ID + ((id) - IO_DEVICE_ID) % 3)  // the channel 0 ID of its kind
+#define ID_LIMIT            (2 + 3 * config.channels)                   // one past the last ID in use
+
+#define MODE_READ           0
+#define MODE_WRITE          1
+#define MODE_BURST_READ     2   // cpu asks the buffer for a block
+#define MODE_BURST_WRITE    3   // transfer device stores a block in the buffer
+#define MODE_BURST_DATA     4   // buffer answers a burst read
+
+// an interrupt from the io device to the transfer device, in place of
+// the next character, when a stream has no more text
+#define INT_END_OF_STREAM   3
+
+// interrupts to the cpu carry their cause and the channel that raised
+// them in the data field, so that one cpu can serve every channel. the
+// interrupt controller in the bus adds how many times it was raised 
+// since the cpu last heard of it.
+#define INT_PAGE_FULL       1   // transfer device: a page is in the buffer
+#define INT_DONE            2   // transfer device: every page has been read back
+#define INT_READ_DONE       3   // buffer: a byte read reached the end of the text
+#define INT_VECTOR(cause, k)    ((cause) | (k) << 2)
+#define INT_CAUSE(data)         ((data) & 3)
+#define INT_CHANNEL(data)       ((data) >> 2 & 15)
+#define INT_COUNT(data)         ((data) >> 6)
+#define INT_COUNT_MAX           (config.data_max >> 6)  // 3 in narrow messages
+
+// messages the code builds itself, from values it knows are in range. 
+// with constant arguments they are constants, and unlike 
+// create_message they check nothing, which is left to the values that
+// come from outside.
+#define MSG(is, cd, halt, id, data) \
+    ((message_t) (is) << 31 | (message_t) (cd) << 30 | (message_t) (halt) << 29 | (message_t) (id) << 24 | (message_t) (data))
+#define MSG_DATA(id, data)      MSG(0, 1, 0, id, data)  // a mode, an address, a character or a count
+#define MSG_INTERRUPT(id, data) MSG(1, 1, 0, id, data)
+#define MSG_ACK(id)             MSG(1, 1, 0, id, 0)
+#define MSG_HALT(id)            MSG(0, 0, 1, id, 0)
+#define MSG_EOI                 MSG(1, 0, 0, BUS_ID, 0)
+#define MSG_BURST(id, mode)     MSG(0, 0, 0, id, mode)
+
+// what a message is to whoever receives it, looked up by its control 
+// byte (the flags and the ID) in a table each device builds at start
+#define CLASS_OTHER         0   // for someone else
+#define CLASS_HALT          1
+#define CLASS_INTERRUPT     2
+#define CLASS_DATA          3
+#define CLASS_BURST         4   // the header of a burst frame
+#define CLASS_ROUTE         5   // the bus: passed on to the devices
+#define CLASS_CONTROLLER    6   // the bus: for its interrupt controller
+
+#define STATE_MODE          0
+#define STATE_ADDRESS       1
+#define STATE_DATA          2
+
+#define OP_TEXT             0   // t <text>, sends the text
+#define OP_NEWLINE          1   // n, sends a newline
+#define OP_DELAY            2   // d <ms>, pauses before the next op
+
+int 
+main (int argc, char **argv) {
+    int opt;
+
+    pick_kernels();
+
+    while ((opt = getopt(argc, argv, "m:t:w:r:bdzWp:B:n:k:f:g:o:s:c:T:j:V")) != -1) {
+        switch (opt) {
+            // run the system as processes, or as threads of one process
+            case 'm':
+                if (strcmp(optarg, "process") == 0) {
+                    config.mode = MODE_PROCESS;
+                }
+                else if (strcmp(optarg, "thread") == 0) {
+                    config.mode = MODE_THREAD;
+                }
+                else if (strcmp(optarg, "engine") == 0) {
+                    config.mode = MODE_ENGINE;
+                }
+                else {
+                    printf("Mode [%s] must be process, thread or engine\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            // transport used between the bus and the devices
+            case 't':
+                if (strcmp(optarg, "pipe") == 0) {
+                    config.transport = TRANSPORT_PIPE;
+                }
+                else if (strcmp(optarg, "ring") == 0) {
+                    config.transport = TRANSPORT_RING;
+                }
+                else {
+                    printf("Transport [%s] must be pipe or ring\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            // what an idle process does while its channels are empty
+            case 'w':
+                if (strcmp(optarg, "spin") == 0) {
+                    config.wait = WAIT_SPIN;
+                }
+                else if (strcmp(optarg, "block") == 0) {
+                    config.wait = WAIT_BLOCK;
+                }
+                else {
+                    printf("Wait [%s] must be spin or block\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            // where the bus sends each message
+            case 'r':
+                if (strcmp(optarg, "broadcast") == 0) {
+                    config.routing = ROUTE_BROADCAST;
+                }
+                else if (strcmp(optarg, "addressed") == 0) {
+                    config.routing = ROUTE_ADDRESSED;
+                }
+                else {
+                    printf("Routing [%s] must be broadcast or addressed\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            // move messages in frames rather than one per syscall
+            case 'b':
+                config.batch = 1;
+                break;
+
+            // move whole pages between transfer device, buffer and cpu
+            // as single burst frames. bursts are point to point, so the
+            // bus has to route by address.
+            case 'd':
+                config.burst = 1;
+                break;
+
+            // pages stay in the slab, and bursts only carry their slot
+            // and length, so this needs bursts too
+            case 'z':
+                config.zero_copy = 1;
+                config.burst = 1;
+                break;
+
+            // 32 bit messages with a 24 bit data field
+            case 'W':
+                config.wide = 1;
+                config.msg_size = 4;
+                config.data_max = 0xFFFFFF;
+                break;
+
+            case 'p':
+                config.page_size = atoi(optarg);
+                break;
+
+            // pages in the buffer, so the transfer device can fill
+            // one while the cpu drains another
+            case 'B':
+                config.banks = atoi(optarg);
+                break;
+
+            // io device, transfer device and buffer sets, each moving
+            // a script of its own into a file of its own
+            case 'n':
+                config.channels = atoi(optarg);
+                if (config.channels < 1 || config.channels > CHANNELS_MAX) {
+                    printf("Channels [%d] must range from 1 to %d\n", config.channels, CHANNELS_MAX);
+                    exit(1);
+                }
+                break;
+
+            // characters the transfer device asks for, and bytes the 
+            // cpu reads, before the first answer comes back
+            case 'k':
+                config.window = atoi(optarg);
+                if (config.window < 1 || config.window > WINDOW_MAX) {
+                    printf("Window [%d] must range from 1 to %d\n", config.window, WINDOW_MAX);
+                    exit(1);
+                }
+                break;
+
+            // text the io device has ready before it is asked for
+            case 'f':
+                config.prefetch = atoi(optarg);
+                if (config.prefetch < 1) {
+                    printf("Prefetch [%d] must be at least 1\n", config.prefetch);
+                    exit(1);
+                }
+                break;
+
+            // characters packed into one answer, one per byte of the 
+            // data field
+            case 'g':
+                config.group = atoi(optarg);
+                break;
+
+            // where the text goes, and how much of it to gather first.
+            // opened once the number of channels is known.
+            case 'o':
+                config.output_path = optarg;
+                break;
+
+            case 's':
+                config.sink_size = atoi(optarg);
+                if (config.sink_size < 0) {
+                    printf("Sink size [%d] must not be negative\n", config.sink_size);
+                    exit(1);
+                }
+                break;
+
+            // print every process's counters to stderr at halt
+            case 'c':
+                if (strcmp(optarg, "table") == 0) {
+                    config.dump = DUMP_TABLE;
+                }
+                else if (strcmp(optarg, "json") == 0) {
+                    config.dump = DUMP_JSON;
+                }
+                else {
+                    printf("Counters [%s] must be table or json\n", optarg);
+                    exit(1);
+                }
+                break;
+
+            // threads running batch instances
+            case 'j':
+                config.workers = atoi(optarg);
+                if (config.workers < 1) {
+                    printf("Workers [%d] must be at least 1\n", config.workers);
+                    exit(1);
+                }
+                break;
+
+            // a simulated clock that jumps over delays, kept by the
+            // engine's scheduler
+            case 'V':
+                config.virtual_time = 1;
+                break;
+
+            // record every message the bus receives, for replay
+            case 'T':
+                config.trace_fd = open(optarg, O_RDWR | O_CREAT | O_TRUNC, 0644);
+                if (config.trace_fd == -1) {
+                    perror("opening trace");
+                    exit(1);
+                }
+                break;
+
+            default:
+                usage(argv[0]);
+        }
+    }
+
+    // a burst frame is meant for one device, and any other would read
+    // its payload as messages, so bursts need addressed routing even
+    // after an explicit -r broadcast
+    if (config.burst) {
+        config.routing = ROUTE_ADDRESSED;
+    }
+
+    // threads share one file table, so closing the unused end of a 
+    // pipe would close it for everyone: they talk over rings instead
+    if (config.mode == MODE_THREAD) {
+        config.transport = TRANSPORT_RING;
+    }
+
+    // only a scheduler that sees every part of the system knows 
+    // when all of it is waiting
+    if (config.virtual_time) {
+        config.mode = MODE_ENGINE;
+    }
+
+    // in the engine, sleeping on a channel means yielding to the 
+    // scheduler, and one thread can only spin on itself
+    if (config.mode == MODE_ENGINE) {
+        config.transport = TRANSPORT_RING;
+        config.wait = WAIT_BLOCK;
+    }
+
+    int bench_mode = argc - optind >= 1 && strcmp(argv[optind], "bench") == 0;
+    int batch_mode = argc - optind >= 1 && strcmp(argv[optind], "batch") == 0;
+
+    // every batch instance runs in an engine of its own
+    if (batch_mode) {
+        config.mode = MODE_ENGINE;
+        config.transport = TRANSPORT_RING;
+        config.wait = WAIT_BLOCK;
+    }
+
+    // a replay takes its options from the trace
+    if (argc - optind >= 1 && strcmp(argv[optind], "replay") == 0) {
+        replay(argc - optind - 1, argv + optind + 1);
+        return 0;
+    }
+
+    if (argc - optind < 1) {
+        usage(argv[0]);
+    }
+
+    // addresses and burst lengths have to fit in the data field
+    if (config.page_size < 1 || config.page_size > config.data_max) {
+        printf("Page size [%d] must range from 1 to %d\n", config.page_size, config.data_max);
+        exit(1);
+    }
+
+    if (config.group < 1 || config.group > (config.wide ? 3 : 1)) {
+        printf("Group [%d] must range from 1 to %d\n", config.group, config.wide ? 3 : 1);
+        exit(1);
+    }
+
+    // per byte reads and writes carry no bank, so only bursts 
+    // can tell the banks apart
+    if (config.banks < 1 || (config.banks > 1 && !config.burst)) {
+        printf("Banks [%d] must be 1, or more with -d\n", config.banks);
+        exit(1);
+    }
+
+    // with -z the slots go over the bus by index
+    if (config.zero_copy && SLOT_BANK(config.channels - 1, config.banks - 1) > config.data_max) {
+        printf("Banks [%d] on %d channels need more than %d slots with -z\n", 
+               config.banks, config.channels, config.data_max);
+        exit(1);
+    }
+
+    // each instance is a single channel
+    if ((bench_mode || batch_mode) && config.channels > 1) {
+        printf("Channels [%d] must be 1 with bench or batch\n", config.channels);
+        exit(1);
+    }
+
+    if (bench_mode) {
+        bench(argc - optind - 1, argv + optind + 1);
+        return 0;
+    }
+
+    if (batch_mode) {
+        batch(argc - optind - 1, argv + optind + 1);
+        return 0;
+    }
+
+    // a file and a number give every channel the same script and 
+    // length. without a number the text is a stream, and ends with the 
+    // script, and there is either one file for every channel or one 
+    // file per channel.
+    int files = argc - optind;
+    int length = 0;
+    if (files == 2 && strspn(argv[optind + 1], "0123456789") == strlen(argv[optind + 1])) {
+        length = atoi(argv[optind + 1]);
+        check_length(length);
+        files = 1;
+    }
+    else {
+        config.stream = 1;
+    }
+
+    if (files != 1 && files != config.channels) {
+        printf("Files [%d] must be 1 or one per channel [%d]\n", files, config.channels);
+        exit(1);
+    }
+
+    // channel k writes to <file>.k, since their text would interleave
+    // on stdout
+    if (config.channels > 1 && config.output_path == NULL) {
+        printf("Channels [%d] need -o\n", config.channels);
+        exit(1);
+    }
+
+    // a bad script is reported here, before any process is started
+    script_t loaded[CHANNELS_MAX];
+    script_t *scripts[CHANNELS_MAX];
+    for (int k = 0; k < files; k++) {
+        load_script(argv[optind + k], &loaded[k]);
+    }
+    for (int k = 0; k < config.channels; k++) {
+        scripts[k] = &loaded[files == 1 ? 0 : k];
+    }
+
+    int output_fds[CHANNELS_MAX];
+    for (int k = 0; k < config.channels; k++) {
+        output_fds[k] = STDOUT_FILENO;
+        if (config.output_path == NULL) 
+            continue;
+
+        char path[PATH_MAX];
+        if (config.channels == 1) {
+            snprintf(path, sizeof path, "%s", config.output_path);
+        }
+        else {
+            snprintf(path, sizeof path, "%s.%d", config.output_path, k);
+        }
+
+        output_fds[k] = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (output_fds[k] == -1) {
+            perror("opening output");
+            exit(1);
+        }
+    }
+
+    run_system(scripts, length, output_fds);
+
+    return 0; 
+}
+
+void
+usage (char *name) {
+    printf("Usage: %s [-m process|thread|engine] [-t pipe|ring] [-w spin|block] [-r broadcast|addressed] [-b] [-d] [-z] [-W] [-p bytes] [-B banks] [-n channels] [-k window] [-f bytes] [-g chars] [-o file] [-s bytes] [-c table|json] [-T trace] [-j workers] [-V] <file_name> [<number>]\n", name);
+    printf("       %s [options] -n <channels> -o <file> <file_name>...\n", name);
+    printf("       %s [options] bench <runs> <lines> <line_length> [delay_min [delay_max]]\n", name);
+    printf("       %s replay <trace> <transfer|buffer> [runs]\n", name);
+    printf("       %s [options] batch <output_directory> <script|directory>...\n", name);
+    exit(1);
+}
+
+// narrow messages split the length in two 8 bit halves
+void
+check_length (int length) {
+    int length_max = config.wide ? config.data_max : 0xFFFF;
+    if (length < 0 || length > length_max) {
+        printf("Number [%d] must range from 0 to %d\n", length, length_max);
+        exit(1);
+    }
+}
+
+// start the cpu and the bus, which starts the devices. the calling 
+// process becomes the bus, and exits once the cpu halts everything.
+void
+run_system (script_t *scripts[], int length, int *output_fds) {
+    map_counters();
+
+    // the rings have to exist before the first fork so that every
+    // process inherits the same shared mapping: 2 for the cpu here,
+    // and 2 for each of the 3 devices per channel created by the bus.
+    if (config.transport == TRANSPORT_RING) {
+        map_rings(2 + 6 * config.channels);
+    }
+    map_slab();
+
+    // a channel from cpu to bus, 
+    // written within cpu, read within bus
+    channel_t cpu_bus;
+    // a channel from bus to cpu, 
+    // written within bus, read within cpu
+    channel_t bus_cpu;
+
+    open_channel(&cpu_bus);
+    open_channel(&bus_cpu);
+  
+    if (config.mode == MODE_ENGINE) {
+        engine = calloc(1, sizeof (engine_t));
+    }
+
+    devices[CPU_ID].output_fds = output_fds;
+    start_device(CPU_ID, &cpu_bus, &bus_cpu, NULL, length);
+
+    // the bus is one more coroutine, and the scheduler returns once
+    // all of them have finished
+    if (config.mode == MODE_ENGINE) {
+        devices[BUS_ID].scripts = scripts;
+        start_device(BUS_ID, &cpu_bus, &bus_cpu, NULL, 0);
+        engine_run();
+
+        // nothing outlives the run, so the next one on this thread
+        // starts from scratch
+        munmap(ring_pool, ring_pool_size * sizeof (ring_t));
+        munmap(slots, COUNTER_SLOTS * sizeof (counters_t));
+        unmap_slab();
+        free_run();
+        ring_pool = NULL;
+        slots = NULL;
+        counters = &unused_counters;
+        return;
+    }
+
+    attach_counters(&slots[BUS_ID]);
+    system_bus(&cpu_bus, &bus_cpu, scripts);
+}
+
+void
+start_device (int id, channel_t *to_bus, channel_t *from_bus, script_t *script, int length) {
+    device_t *device = &devices[id];
+    device->id = id;
+    device->slot = &slots[id];
+    device->slab = slab;
+    device->to_bus = to_bus;
+    device->from_bus = from_bus;
+    device->script = script;
+    device->length = length;
+
+    if (config.mode == MODE_THREAD) {
+        if (pthread_create(&device->thread, NULL, run_device, device) != 0) {
+            perror("creating thread");
+            exit(3);
+        }
+        return;
+    }
+
+    if (config.mode == MODE_ENGINE) {
+        engine_start(id);
+        return;
+    }
+
+    switch (fork()) { 
+        // error 
+        case -1: 
+            exit(3); 
+    
+        // child process, which ends inside the device
+        case 0: 
+            run_device(device);
+            exit(0);
+
+        default:
+            break;
+    } 
+}
+
+void *
+run_device (void *arg) {
+    device_t *device = arg;
+    attach_counters(device->slot);
+    slab = device->slab;
+
+    switch (device->id) {
+        case CPU_ID:
+            computer_system(device->to_bus, device->from_bus, device->length, device->output_fds);
+            return NULL;
+
+        // only started this way by the engine
+        case BUS_ID:
+            system_bus(device->to_bus, device->from_bus, device->scripts);
+            return NULL;
+    }
+
+    switch (KIND_OF(device->id)) {
+        case IO_DEVICE_ID:
+            io_device(device->to_bus, device->from_bus, device->script, CHANNEL_OF(device->id));
+            break;
+
+        case TRANSFER_DEVICE_ID:
+            transfer_device(device->to_bus, device->from_bus, CHANNEL_OF(device->id));
+            break;
+
+        case BUFFER_ID:
+            buffer(device->to_bus, device->from_bus, CHANNEL_OF(device->id));
+            break;
+    }
+
+    return NULL;
+}
+
+// called by the bus at halt, once it has passed the halt on. the bus
+// is idle until the devices exit, so that time counts as blocked
+void
+wait_for_devices (void) {
+    long slept = now_ns();
+    counters->blocks++;
+
+    if (config.mode == MODE_ENGINE) {
+        engine->current->joining = 1;
+        engine_yield();
+    }
+    else if (config.mode == MODE_THREAD) {
+        for (int id = CPU_ID; id < ID_LIMIT; id++) {
+            if (id != BUS_ID) 
+                pthread_join(devices[id].thread, NULL);
+        }
+    }
+    else {
+        while (wait(NULL) > 0) 
+            ;
+    }
+
+    counters->blocked_ns += now_ns() - slept;
+}
+
+// the end of a device: its process exits, or only its thread
+void
+finish (void) {
+    if (config.mode == MODE_ENGINE) {
+        stop_counters();
+        engine->current->done = 1;
+        engine->live--;
+        setcontext(&engine->scheduler);
+    }
+
+    if (config.mode == MODE_THREAD) {
+        stop_counters();
+        pthread_exit(NULL);
+    }
+
+    exit(0);
+}
+
+// a delay is idle time, so it counts as blocked like a wait for a message
+void
+delay (int ms) {
+    long slept = now_ns();
+    counters->blocks++;
+
+    if (config.mode == MODE_ENGINE) 
+        engine_sleep(ms * 1000000L);
+    else 
+        usleep(ms * 1000);
+
+    counters->blocked_ns += now_ns() - slept;
+}
+
+void
+engine_start (int id) {
+    coroutine_t *co = &engine->coroutines[id];
+
+    co->stack = malloc(COROUTINE_STACK);
+    if (co->stack == NULL || getcontext(&co->context) == -1) {
+        perror("creating coroutine");
+        exit(3);
+    }
+    co->context.uc_stack.ss_sp = co->stack;
+    co->context.uc_stack.ss_size = COROUTINE_STACK;
+    co->context.uc_link = &engine->scheduler;
+    makecontext(&co->context, engine_entry, 0);
+
+    co->started = 1;
+    co->counters = &unused_counters;
+    engine->live++;
+}
+
+void
+engine_entry (void) {
+    run_device(&devices[engine->current - engine->coroutines]);
+    finish();
+}
+
+// resume every coroutine that can make progress, in ID order, until 
+// all have finished. when none can, sleep until the next timer.
+void
+engine_run (void) {
+    long started = now_ns();
+
+    while (engine->live > 0) {
+        int ran = 0;
+        long now = 0;
+        long next_wake = 0;
+
+        for (int i = 0; i < COUNTER_SLOTS; i++) {
+            coroutine_t *co = &engine->coroutines[i];
+            if (!co->started || co->done) 
+                continue;
+
+            if (!engine_runnable(co, &now)) {
+                if (co->wake_at != 0 && (next_wake == 0 || co->wake_at < next_wake)) 
+                    next_wake = co->wake_at;
+                continue;
+            }
+
+            co->wake_at = 0;
+            co->wait_count = 0;
+            co->wait_ring = NULL;
+            co->joining = 0;
+
+            engine->current = co;
+            counters = co->counters;
+            swapcontext(&engine->scheduler, &co->context);
+            co->counters = counters;
+            engine->current = NULL;
+            ran = 1;
+        }
+
+        if (ran) 
+            continue;
+
+        if (next_wake == 0) {
+            fprintf(stderr, "Engine stalled with [%d] coroutines waiting\n", engine->live);
+            exit(1);
+        }
+
+        // nothing happens until the next timer, so simulated time 
+        // skips straight to it
+        if (config.virtual_time) {
+            engine->clock = next_wake;
+            continue;
+        }
+
+        long wait = next_wake - now_ns();
+        if (wait > 0) {
+            struct timespec ts = { .tv_sec = wait / 1000000000L, .tv_nsec = wait % 1000000000L };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    for (int i = 0; i < COUNTER_SLOTS; i++) {
+        free(engine->coroutines[i].stack);
+    }
+    // without -V, simulated time is real time
+    simulated_ns = config.virtual_time ? engine->clock : now_ns() - started;
+    free(engine);
+    engine = NULL;
+}
+
+int
+engine_runnable (coroutine_t *co, long *now) {
+    if (co->joining) 
+        return engine->live == 1;
+
+    if (co->wait_ring != NULL) 
+        return RING_SIZE - (atomic_load(&co->wait_ring->tail) - atomic_load(&co->wait_ring->head)) >= co->wait_room;
+
+    if (co->wake_at != 0) {
+        if (*now == 0) 
+            *now = engine_now();
+        return *now >= co->wake_at;
+    }
+
+    if (co->wait_count == 0) 
+        return 1;
+
+    for (int i = 0; i < co->wait_count; i++) {
+        channel_t *ch = co->wait_in[i];
+        if (ch->in_length - ch->in_start >= config.msg_size) 
+            return 1;
+        if (atomic_load(&ch->ring->tail) != atomic_load(&ch->ring->head)) 
+            return 1;
+    }
+    return 0;
+}
+
+// give the other coroutines a turn, coming back on the next pass
+void
+engine_yield (void) {
+    swapcontext(&engine->current->context, &engine->scheduler);
+}
+
+// come back once one of the channels has something to read
+void
+engine_wait (channel_t *in[], int count) {
+    long slept = now_ns();
+    counters->blocks++;
+
+    engine->current->wait_in = in;
+    engine->current->wait_count = count;
+    engine_yield();
+
+    counters->blocked_ns += now_ns() - slept;
+}
+
+// come back once the ring has room for 'count' more bytes
+void
+engine_wait_room (ring_t *ring, int count) {
+    engine->current->wait_ring = ring;
+    engine->current->wait_room = count;
+    engine_yield();
+}
+
+// come back after 'ns' nanoseconds
+void
+engine_sleep (long ns) {
+    engine->current->wake_at = engine_now() + ns;
+    engine_yield();
+}
+
+// the time timers are set and checked against: real, or with -V the 
+// simulated clock, which only moves when every coroutine is waiting
+long
+engine_now (void) {
+    return config.virtual_time ? engine->clock : now_ns();
+}
+
+void
+computer_system (channel_t *cpu_bus, channel_t *bus_cpu, int length, int *output_fds) {
+    message_t msg;
+
+    // the buffer's end of text interrupt only repeats what the byte 
+    // replies already tell, so the controller keeps it
+    msg = MSG_DATA(BUS_ID, 1 << INT_READ_DONE);
+    write_message(cpu_bus, msg);
+
+    // every channel is given the same length. a stream has none to 
+    // pass on, the transfer devices start asking for characters by 
+    // themselves.
+    for (int k = 0; k < config.channels && !config.stream; k++) {
+        if (config.wide) {
+            msg = create_message(0, 1, 0, CHANNEL_TRANSFER(k), length);
+            write_message(cpu_bus, msg);
+        }
+        else {
+            msg = create_message(0, 1, 0, CHANNEL_TRANSFER(k), (length & 0b1111111100000000) >> 8);
+            write_message(cpu_bus, msg);
+
+            msg = create_message(0, 1, 0, CHANNEL_TRANSFER(k), length & 0b11111111);
+            write_message(cpu_bus, msg);
+        }
+    }
+
+    close_read_end(cpu_bus); // close read end of cpu_bus
+    close_write_end(bus_cpu); // close write end of bus_cpu
+
+    // each page is written out as soon as it is read back, so only a
+    // page (and the sinks' own buffers) is ever held here
+    char *page = slab_page(SLOT_CPU);
+    char *text = page;
+    int index = 0;
+
+    // every channel's text goes to a sink of its own
+    cpu_t cpu = {.cpu_bus = cpu_bus};
+    for (int k = 0; k < config.channels; k++) {
+        open_sink(&cpu.sinks[k], output_fds[k]);
+    }
+
+    // only one page is read at a time, taking the channels in turn
+    int current = 0;    // the channel being read, or read last
+    int reading = 0;
+    int replies = 0;
+    int asked = 0;      // addresses asked for in a byte by byte read
+    int in_service = 0; // an interrupt was delivered and has no EOI yet
+
+    static void (*const handlers[4]) (cpu_t *cpu, int channel, int count) = {
+        [0]             = cpu_spurious,
+        [INT_PAGE_FULL] = cpu_page_full,
+        [INT_DONE]      = cpu_done,
+        [INT_READ_DONE] = cpu_spurious,
+    };
+
+    unsigned char classes[256];
+    classify(classes, CPU_ID);
+
+    while (1) {
+        msg = await_message(bus_cpu, cpu_bus);
+        int class = classes[get_control(msg)];
+        if (msg == 0 || class == CLASS_OTHER) 
+            continue;
+
+        if (class == CLASS_BURST) {
+            // a page read back in one burst
+            int address;
+            int length = receive_descriptor(bus_cpu, cpu_bus, &address);
+
+            // with -z the text never left the slab, the address is 
+            // the slot it is in
+            if (config.zero_copy) {
+                text = slab_page(address);
+            }
+            else {
+                receive_bytes(bus_cpu, cpu_bus, (unsigned char *) page, length);
+                text = page;
+            }
+            index = length;
+            reading = 0;
+        }
+        else if (class == CLASS_DATA) {
+            // a single byte read back from the buffer. the empty 
+            // bytes past the end of the text are not part of it.
+            if (get_data(msg) != 0) 
+                page[index++] = get_data(msg);
+
+            // every address has been answered. until then each answer
+            // makes room in the window for the next address.
+            replies--;
+            if (replies == 0) 
+                reading = 0;
+            else if (asked < config.page_size) 
+                read_byte(cpu_bus, current, asked++);
+        }
+        else if (class == CLASS_INTERRUPT) {
+            int data = get_data(msg);
+            handlers[INT_CAUSE(data)](&cpu, INT_CHANNEL(data), INT_COUNT(data));
+            in_service = 1;
+        }
+
+        // a read just finished: pass the page on and acknowledge the
+        // transfer device so that it can reuse the bank
+        if (!reading && index > 0) {
+            sink_write(&cpu.sinks[current], text, index);
+            index = 0;
+        }
+        if (!reading && (class == CLASS_BURST || class == CLASS_DATA)) {
+            msg = MSG_ACK(CHANNEL_TRANSFER(current));
+            write_message(cpu_bus, msg);
+            counters->interrupts_acked++;
+        }
+
+        // the next channel with a page waiting, after the one read last
+        for (int n = 1; n <= config.channels && !reading; n++) {
+            int k = (current + n) % config.channels;
+            if (cpu.pending[k] == 0) 
+                continue;
+
+            if (config.burst) {
+                // read the whole page back in one burst
+                write_burst(cpu_bus, CHANNEL_BUFFER(k), MODE_BURST_READ, 0, config.page_size, NULL);
+            }
+            else {
+                // get the data from buffer byte by byte, with at most
+                // a window of addresses asked for at once. the read is
+                // over once every address has been answered.
+                for (asked = 0; asked < config.page_size && asked < config.window; asked++) {
+                    read_byte(cpu_bus, k, asked);
+                }
+                replies = config.page_size;
+            }
+
+            cpu.pending[k]--;
+            current = k;
+            reading = 1;
+        }
+
+        // only once every page it knows of is read back does the cpu 
+        // take the next interrupt, so that pages filled meanwhile come
+        // in one delivery
+        if (in_service && !reading) {
+            msg = MSG_EOI;
+            write_message(cpu_bus, msg);
+            in_service = 0;
+        }
+    }
+}
+
+// pages are waiting in a channel's buffer
+void
+cpu_page_full (cpu_t *cpu, int channel, int count) {
+    cpu->pending[channel] += count;
+}
+
+// a channel's text is all out. once every channel's is, halt.
+void
+cpu_done (cpu_t *cpu, int channel, int count) {
+    (void) channel;
+
+    cpu->done += count;
+    if (cpu->done < config.channels) 
+        return;
+
+    for (int k = 0; k < config.channels; k++) {
+        flush_sink(&cpu->sinks[k]);
+        if (cpu->sinks[k].fd != STDOUT_FILENO && (k == 0 || cpu->sinks[k].fd != cpu->sinks[k - 1].fd)) 
+            close(cpu->sinks[k].fd);
+    }
+
+    // send halt to all devices
+    message_t msg = MSG_HALT(BUS_ID);
+    write_message(cpu->cpu_bus, msg);
+    flush_channel(cpu->cpu_bus);
+
+    finish();
+}
+
+// a cause the cpu has nothing to do for
+void
+cpu_spurious (cpu_t *cpu, int channel, int count) {
+    (void) cpu;
+    (void) channel;
+    (void) count;
+}
+
+void
+system_bus (channel_t *cpu_bus, channel_t *bus_cpu, script_t *scripts[]) {
+    int count = 1 + 3 * config.channels;    // the cpu, then every device
+
+    // the bus talks to each device over a pair of channels, held in
+    // the same order as 'ids'. the cpu's pair comes from the caller.
+    channel_t *inbound[COUNTER_SLOTS]  = {cpu_bus};
+    channel_t *outbound[COUNTER_SLOTS] = {bus_cpu};
+    int ids[COUNTER_SLOTS] = {CPU_ID};
+
+    channel_t *to_bus = run_alloc(count * sizeof (channel_t));
+    channel_t *from_bus = run_alloc(count * sizeof (channel_t));
+
+    // ======== CREATE THE IO DEVICE, TRANSFER DEVICE AND BUFFER OF EACH CHANNEL ========
+
+    for (int i = 1; i < count; i++) {
+        ids[i] = IO_DEVICE_ID + i - 1;
+        inbound[i] = &to_bus[i];
+        outbound[i] = &from_bus[i];
+
+        open_channel(inbound[i]);
+        open_channel(outbound[i]);
+        share_doorbell(inbound[i], cpu_bus);
+
+        script_t *script = KIND_OF(ids[i]) == IO_DEVICE_ID ? scripts[CHANNEL_OF(ids[i])] : NULL;
+        start_device(ids[i], inbound[i], outbound[i], script, 0);
+    }
+    // =======================================
+
+    close_write_end(cpu_bus); // close write end of cpu_bus
+    close_read_end(bus_cpu); // close read end of bus_cpu
+
+    for (int i = 1; i < count; i++) {
+        close_write_end(inbound[i]);  // close write end of dev_bus
+        close_read_end(outbound[i]);  // close read end of bus_dev
+    }
+
+    message_t msg = 0;
+    int idle;
+
+    unsigned char *frame = run_alloc(3 * MSGSIZE_MAX + config.page_size);
+
+    if (config.trace_fd >= 0) 
+        map_trace();
+
+    int epoll_fd = -1;
+    int first = 0;      // the device served first in a pass
+    intc_t intc = {0};
+
+    unsigned char classes[256];
+    classify_bus(classes);
+
+    // when blocking over pipes, sleep in epoll on every inbound pipe
+    if (config.wait == WAIT_BLOCK && config.transport == TRANSPORT_PIPE) {
+        epoll_fd = epoll_create1(0);
+        if (epoll_fd < 0) {
+            perror("creating epoll");
+            exit(2);
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct epoll_event event = {.events = EPOLLIN, .data.fd = inbound[i]->pipe[0]};
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, inbound[i]->pipe[0], &event) < 0) {
+                perror("adding pipe to epoll");
+                exit(2);
+            }
+        }
+    }
+
+    // receive a message from each device and pass it on,
+    // either to every device or only to the one it names.
+    // each pass starts one device further on, so that none of the
+    // channels is always served last.
+    while (1) {
+        idle = 1;
+
+        for (int n = 0; n < count; n++) {
+            int i = (first + n) % count;
+
+            // when batching, route everything that came in with the 
+            // frame before moving on to the next device
+            int most = config.batch ? FRAME_SIZE / config.msg_size : 1;
+
+            for (int m = 0; m < most; m++) {
+                msg = receive_message(inbound[i], outbound[i]);
+                if (msg == 0) 
+                    break;
+
+                idle = 0;
+                if (stats != NULL) 
+                    stats->messages++;
+
+                int class = classes[get_control(msg)];
+                if (trace.fd >= 0 && class != CLASS_BURST) 
+                    trace_message(ids[i], msg, NULL, 0);
+
+                if (class == CLASS_HALT) {
+                    if (config.routing == ROUTE_ADDRESSED) {
+                        // one halt for everybody but the cpu that sent it
+                        msg = MSG_HALT(BROADCAST_ID);
+                        route_message(outbound, ids, count, i, msg, NULL, 0);
+                    }
+                    else {
+                        for (int j = 1; j < count; j++) {
+                            message_t msg_halt = MSG_HALT(ids[j]);
+                            write_message(outbound[j], msg_halt);
+                        }
+                    }
+
+                    for (int j = 0; j < count; j++) {
+                        flush_channel(outbound[j]);
+                    }
+
+                    // every device has stopped counting once it exits
+                    if (config.dump != DUMP_NONE) {
+                        wait_for_devices();
+                        stop_counters();
+                        dump_counters();
+                    }
+
+                    // the engine goes on until the devices have seen the halt
+                    if (config.mode == MODE_ENGINE) 
+                        finish();
+                    exit(0);
+                }
+
+                if (class == CLASS_CONTROLLER) {
+                    intc_accept(&intc, msg);
+                    continue;
+                }
+
+                if (class == CLASS_BURST) {
+                    // pass the burst on in one piece, so that nothing 
+                    // else can end up in the middle of it
+                    int frame_length = receive_frame(inbound[i], outbound[i], msg, frame);
+                    if (trace.fd >= 0) 
+                        trace_message(ids[i], msg, frame + config.msg_size, frame_length - config.msg_size);
+                    route_message(outbound, ids, count, i, msg, frame, frame_length);
+                    continue;
+                }
+
+                route_message(outbound, ids, count, i, msg, NULL, 0);
+            }
+        }
+        first = (first + 1) % count;
+
+        // the cpu hears of interrupts raised in this pass once it is 
+        // done with the last one
+        intc_deliver(&intc, outbound[0]);
+
+        // everything routed in this pass goes out before the next one
+        for (int i = 0; i < count; i++) {
+            flush_channel(outbound[i]);
+        }
+
+        if (idle && config.wait == WAIT_BLOCK) {
+            wait_for_channels(inbound, count, epoll_fd);
+        }
+    }
+}
+
+// write msg to the devices that should see it. broadcast routing
+// copies it to every device (the sender included), addressed routing
+// only to the device named by its ID, or to everyone but the sender
+// when it names BROADCAST_ID. when msg starts a burst, 'frame' holds 
+// the whole burst and is written instead.
+void
+route_message (channel_t *outbound[], int ids[], int count, int from, 
+               message_t msg, unsigned char *frame, int frame_length) {
+    int id = get_id(msg);
+
+    for (int i = 0; i < count; i++) {
+        int send = 0;
+
+        if (config.routing == ROUTE_BROADCAST) 
+            send = 1;
+        else if (id == BROADCAST_ID) 
+            send = i != from;
+        else 
+            send = ids[i] == id;
+
+        if (!send) 
+            continue;
+
+        if (frame != NULL) {
+            write_bytes(outbound[i], frame, frame_length);
+            counters->bursts++;
+        }
+        else 
+            write_message(outbound[i], msg);
+    }
+}
+
+// takes the messages meant for the interrupt controller: interrupts 
+// raised for the cpu, which are counted against their vector, and from
+// the cpu its EOI (an interrupt to the bus) and its mask (data to the
+// bus)
+void
+intc_accept (intc_t *intc, message_t msg) {
+    if (get_id(msg) == CPU_ID) {
+        int data = get_data(msg);
+        intc->pending[INT_CAUSE(data)][INT_CHANNEL(data)]++;
+    }
+    else if (check_interrupt(msg)) 
+        intc->in_service = 0;
+    else 
+        intc->mask = get_data(msg);
+}
+
+// unless the cpu is still serving the last one, delivers the most 
+// urgent vector with anything pending, along with how many times it 
+// was raised. pages come before the end of a channel, and channels 
+// take turns within a cause.
+void
+intc_deliver (intc_t *intc, channel_t *bus_cpu) {
+    static const int priority[] = {INT_PAGE_FULL, INT_READ_DONE, INT_DONE};
+
+    if (intc->in_service) 
+        return;
+
+    for (int p = 0; p < 3; p++) {
+        int cause = priority[p];
+        if (intc->mask & 1 << cause) 
+            continue;
+
+        for (int n = 0; n < config.channels; n++) {
+            int k = (intc->next + n) % config.channels;
+            int count = intc->pending[cause][k];
+            if (count == 0) 
+                continue;
+
+            if (count > INT_COUNT_MAX) 
+                count = INT_COUNT_MAX;
+            intc->pending[cause][k] -= count;
+            intc->next = (k + 1) % config.channels;
+            intc->in_service = 1;
+
+            message_t msg = MSG_INTERRUPT(CPU_ID, INT_VECTOR(cause, k) | count << 6);
+            write_message(bus_cpu, msg);
+            counters->interrupts_raised++;
+            return;
+        }
+    }
+}
+
+void 
+io_device (channel_t *io_bus, channel_t *bus_io, script_t *script, int channel) {
+    // the op being served, and the next byte of its text
+    int op = 0;
+    int position = 0;
+
+    // text parsed ahead of the requests, up to the next delay, so that 
+    // a request is answered as soon as it comes in
+    char *fifo = run_alloc(config.prefetch);
+    int head = 0;
+    int count = 0;
+
+    // requests not answered yet, up to the transfer device's window, 
+    // oldest first: the characters each wants, or with -z its slot
+    int *requests = run_alloc(config.window * sizeof (int));
+    int first = 0;
+    int requested = 0;
+
+    message_t msg = 0;
+
+    unsigned char classes[256];
+    classify(classes, CHANNEL_IO(channel));
+
+    close_read_end(io_bus); // close read end of bus_io
+    close_write_end(bus_io); // close write end of io_bus
+
+    while (1) {
+        // top the fifo up. the text after a delay is only taken once 
+        // the delay is over.
+        if (count < config.prefetch) {
+            memmove(fifo, fifo + head, count);
+            head = 0;
+            count = fill_page(script, &op, &position, fifo, count, config.prefetch);
+        }
+
+        // everything before the delay is out: sit it out, without 
+        // holding the last characters back for the whole of it
+        if (count == 0 && op < script->count && script->ops[op].type == OP_DELAY) {
+            flush_channel(io_bus);
+            delay(script->ops[op].length);
+            op++;
+            continue;
+        }
+
+        // a stream ends with the answer to the next request
+        int ended = count == 0 && op == script->count;
+        if (ended && !config.stream) {
+            flush_channel(io_bus);
+            await_halt(bus_io, io_bus);
+        }
+
+        // only sleep on the bus while there is no request to answer
+        if (requested == 0) 
+            msg = await_message(bus_io, io_bus);
+        else 
+            msg = receive_message(bus_io, io_bus);
+
+        if (msg != 0) {
+            switch (classes[get_control(msg)]) {
+                case CLASS_HALT:
+                    finish();
+
+                case CLASS_DATA:
+                    requests[(first + requested) % config.window] = get_data(msg);
+                    requested++;
+                    break;
+            }
+        }
+
+        if (requested > 0 && ended) {
+            message_t msg1 = MSG_INTERRUPT(CHANNEL_TRANSFER(channel), INT_END_OF_STREAM);
+            write_message(io_bus, msg1);
+            counters->interrupts_raised++;
+            flush_channel(io_bus);
+            await_halt(bus_io, io_bus);
+        }
+
+        while (requested > 0 && count > 0) {
+            int request = requests[first];
+            first = (first + 1) % config.window;
+            requested--;
+
+            if (config.zero_copy) {
+                // the fifo starts a page in the slab, and the text after
+                // it follows up to the next delay. the transfer device 
+                // is only told how much there is.
+                char *page = slab_page(request);
+                int filled = count < config.page_size ? count : config.page_size;
+                memcpy(page, fifo + head, filled);
+                head += filled;
+                count -= filled;
+                filled = fill_page(script, &op, &position, page, filled, config.page_size);
+
+                message_t msg1 = MSG_DATA(CHANNEL_TRANSFER(channel), filled);
+                write_message(io_bus, msg1);
+                continue;
+            }
+
+            // as many characters as were asked for and are ready, 
+            // packed low byte first into one reply
+            int data = 0;
+            for (int n = 0; n < request && count > 0; n++) {
+                data |= (unsigned char) fifo[head++] << (8 * n);
+                count--;
+            }
+
+            message_t msg1 = MSG_DATA(CHANNEL_TRANSFER(channel), data);
+            write_message(io_bus, msg1);
+        }
+    }
+}
+
+// the scripts of a batch, and where their outputs go
+char      **batch_paths = NULL;
+script_t   *batch_scripts = NULL;
+int         batch_count = 0;
+int         batch_size = 0;
+char       *batch_output = NULL;
+worker_t   *workers = NULL;
+int         worker_count = 0;
+
+// batch <output_directory> <script|directory>...
+// runs one system per script, each in an engine of its own, on a pool
+// of worker threads. the text of 'name' goes to 'name.out' in the 
+// output directory, and one JSON line sums the batch up on stdout.
+void
+batch (int argc, char **argv) {
+    if (argc < 2) {
+        printf("Batch needs <output_directory> <script|directory>...\n");
+        exit(1);
+    }
+    if (config.trace_fd >= 0) {
+        printf("A batch cannot be traced\n");
+        exit(1);
+    }
+
+    batch_output = argv[0];
+    for (int i = 1; i < argc; i++) {
+        add_scripts(argv[i]);
+    }
+
+    // outputs are named after their scripts alone, so two scripts with
+    // the same name in different directories would write the same file
+    char **names = malloc(batch_count * sizeof (char *));
+    for (int i = 0; i < batch_count; i++) {
+        names[i] = basename(batch_paths[i]);
+    }
+    qsort(names, batch_count, sizeof (char *), compare_paths);
+
+    for (int i = 1; i < batch_count; i++) {
+        if (strcmp(names[i - 1], names[i]) == 0) {
+            printf("Scripts named [%s] would all write [%s/%s.out]\n", names[i], batch_output, names[i]);
+            exit(1);
+        }
+    }
+    free(names);
+
+    // every script is loaded and checked before anything runs. each
+    // run streams its script, so none is too long for the number
+    batch_scripts = malloc(batch_count * sizeof (script_t));
+    long bytes = 0;
+
+    for (int i = 0; i < batch_count; i++) {
+        load_script(batch_paths[i], &batch_scripts[i]);
+        bytes += batch_scripts[i].chars;
+    }
+    config.stream = 1;
+
+    worker_count = config.workers > 0 ? config.workers : sysconf(_SC_NPROCESSORS_ONLN);
+    if (worker_count < 1) 
+        worker_count = 1;
+    workers = calloc(worker_count, sizeof (worker_t));
+
+    // deal the scripts out like cards, the stealing evens out the rest
+    for (int w = 0; w < worker_count; w++) {
+        deque_t *deque = &workers[w].deque;
+        deque->tasks = malloc((batch_count / worker_count + 1) * sizeof (int));
+
+        long n = 0;
+        for (int i = w; i < batch_count; i += worker_count) {
+            deque->tasks[n++] = i;
+        }
+        atomic_init(&deque->top, 0);
+        atomic_init(&deque->bottom, n);
+    }
+
+    long start = now_ns();
+
+    for (int w = 0; w < worker_count; w++) {
+        if (pthread_create(&workers[w].thread, NULL, batch_worker, &workers[w]) != 0) {
+            perror("creating worker");
+            exit(3);
+        }
+    }
+
+    long steals = 0;
+    long simulated = 0;
+    for (int w = 0; w < worker_count; w++) {
+        pthread_join(workers[w].thread, NULL);
+        steals += workers[w].steals;
+        simulated += workers[w].simulated_ns;
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("{\"scripts\": %d, \"workers\": %d, \"bytes\": %ld, \"wall_s\": %.6f, \"simulated_s\": %.6f, "
+           "\"scripts_per_s\": %.1f, \"bytes_per_s\": %.0f, \"steals\": %ld}\n",
+           batch_count, worker_count, bytes, seconds, simulated / 1e9, 
+           batch_count / seconds, bytes / seconds, steals);
+}
+
+// a script, or every regular file in a directory, in name order
+void
+add_scripts (char *path) {
+    struct stat st;
+    if (stat(path, &st) == -1) {
+        perror(path);
+        exit(1);
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        add_path(path);
+        return;
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        perror(path);
+        exit(1);
+    }
+
+    int first = batch_count;
+    struct dirent *entry;
+
+    while ((entry = readdir(dir)) != NULL) {
+        char *file = malloc(strlen(path) + strlen(entry->d_name) + 2);
+        sprintf(file, "%s/%s", path, entry->d_name);
+
+        if (stat(file, &st) == 0 && S_ISREG(st.st_mode)) 
+            add_path(file);
+        else 
+            free(file);
+    }
+    closedir(dir);
+
+    qsort(batch_paths + first, batch_count - first, sizeof (char *), compare_paths);
+}
+
+void
+add_path (char *path) {
+    if (batch_count == batch_size) {
+        batch_size = batch_size == 0 ? 64 : batch_size * 2;
+        batch_paths = realloc(batch_paths, batch_size * sizeof (char *));
+    }
+    batch_paths[batch_count++] = path;
+}
+
+// takes scripts from its own deque, then from the others, until 
+// every deque is empty. nothing is added once the batch has started,
+// so finding them all empty once means the work is done.
+void *
+batch_worker (void *arg) {
+    worker_t *worker = arg;
+    int self = worker - workers;
+
+    while (1) {
+        int task = deque_pop(&worker->deque);
+
+        for (int i = 1; task < 0 && i < worker_count; i++) {
+            deque_t *victim = &workers[(self + i) % worker_count].deque;
+
+            // a lost race means someone else made progress, try again
+            do {
+                task = deque_steal(victim);
+            } while (task == -2);
+
+            if (task >= 0) 
+                worker->steals++;
+        }
+
+        if (task < 0) 
+            return NULL;
+
+        char *name = basename(batch_paths[task]);
+        char *output = malloc(strlen(batch_output) + strlen(name) + 6);
+        sprintf(output, "%s/%s.out", batch_output, name);
+
+        int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1) {
+            perror(output);
+            exit(1);
+        }
+        free(output);
+
+        // the cpu closes the file when it halts
+        script_t *one = &batch_scripts[task];
+        run_system(&one, 0, &fd);
+        unload_script(one);
+        worker->scripts++;
+        worker->simulated_ns += simulated_ns;
+    }
+}
+
+// the owner's end. returns -1 when the deque is empty.
+int
+deque_pop (deque_t *deque) {
+    long bottom = atomic_load(&deque->bottom) - 1;
+    atomic_store(&deque->bottom, bottom);
+    long top = atomic_load(&deque->top);
+
+    if (top > bottom) {
+        atomic_store(&deque->bottom, bottom + 1);
+        return -1;
+    }
+
+    int task = deque->tasks[bottom];
+
+    // the last one may be stolen at the same time
+    if (top == bottom) {
+        if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1)) 
+            task = -1;
+        atomic_store(&deque->bottom, bottom + 1);
+    }
+
+    return task;
+}
+
+// the thieves' end. returns -1 when the deque is empty, and -2 when 
+// another thread took the task first.
+int
+deque_steal (deque_t *deque) {
+    long top = atomic_load(&deque->top);
+    long bottom = atomic_load(&deque->bottom);
+
+    if (top >= bottom) 
+        return -1;
+
+    int task = deque->tasks[top];
+    if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1)) 
+        return -2;
+
+    return task;
+}
+
+int
+compare_paths (const void *a, const void *b) {
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+// maps the -T file and writes the header. the bus is the only writer.
+void
+map_trace (void) {
+    trace.fd = config.trace_fd;
+    trace.size = 1 << 20;
+    trace.length = 0;
+    trace.start_ns = now_ns();
+
+    if (ftruncate(trace.fd, trace.size) == -1) {
+        perror("sizing trace");
+        exit(2);
+    }
+    trace.map = mmap(NULL, trace.size, PROT_READ | PROT_WRITE, MAP_SHARED, trace.fd, 0);
+    if (trace.map == MAP_FAILED) {
+        perror("mapping trace");
+        exit(2);
+    }
+
+    trace_header_t header = {
+        .magic = "CPUTRACE",
+        .version = 5,
+        .wide = config.wide,
+        .page_size = config.page_size,
+        .banks = config.banks,
+        .burst = config.burst,
+        .routing = config.routing,
+        .stream = config.stream,
+        .zero_copy = config.zero_copy,
+        .channels = config.channels,
+        .window = config.window,
+        .group = config.group,
+    };
+    memcpy(trace.map, &header, sizeof header);
+    trace.length = sizeof header;
+
+    // however the bus exits, the file is cut down to what was written
+    atexit(close_trace);
+}
+
+void
+trace_message (int source, message_t msg, unsigned char *tail, int tail_length) {
+    size_t need = (sizeof (trace_record_t) + tail_length + 7) & ~(size_t) 7;
+
+    if (trace.length + need > trace.size) {
+        size_t size = trace.size * 2;
+        while (trace.length + need > size) 
+            size *= 2;
+
+        if (ftruncate(trace.fd, size) == -1) {
+            perror("growing trace");
+            exit(2);
+        }
+        trace.map = mremap(trace.map, trace.size, size, MREMAP_MAYMOVE);
+        if (trace.map == MAP_FAILED) {
+            perror("remapping trace");
+            exit(2);
+        }
+        trace.size = size;
+    }
+
+    trace_record_t record = {
+        .time_ns = now_ns() - trace.start_ns,
+        .source = source,
+        .msg = msg,
+        .tail_length = tail_length,
+    };
+    memcpy(trace.map + trace.length, &record, sizeof record);
+    memcpy(trace.map + trace.length + sizeof record, tail, tail_length);
+    trace.length += need;
+}
+
+void
+close_trace (void) {
+    munmap(trace.map, trace.size);
+    if (ftruncate(trace.fd, trace.length) == -1) 
+        perror("truncating trace");
+    close(trace.fd);
+}
+
+// replay <trace> <transfer|buffer> [runs [channel]]
+// feeds one device of the channel (default 0) every message the bus
+// delivered to it in a traced run, as fast as it can take them, and 
+// checks that it answers with
+// exactly the messages it sent in that run. prints the timing as JSON
+// and exits with 1 when the answers differ.
+void
+replay (int argc, char **argv) {
+    if (argc < 2 || argc > 4) {
+        printf("Replay needs <trace> <transfer|buffer> [runs [channel]]\n");
+        exit(1);
+    }
+
+    int transfer = strcmp(argv[1], "transfer") == 0;
+    if (!transfer && strcmp(argv[1], "buffer") != 0) {
+        printf("Device [%s] must be transfer or buffer\n", argv[1]);
+        exit(1);
+    }
+
+    int runs = argc > 2 ? atoi(argv[2]) : 1;
+    if (runs < 1) {
+        printf("Runs [%d] must be at least 1\n", runs);
+        exit(1);
+    }
+
+    int channel = argc > 3 ? atoi(argv[3]) : 0;
+
+    int fd = open(argv[0], O_RDONLY);
+    if (fd == -1) {
+        perror("opening trace");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("reading trace");
+        exit(1);
+    }
+
+    trace_header_t header;
+    if ((size_t) st.st_size < sizeof header || pread(fd, &header, sizeof header, 0) != sizeof header 
+        || memcmp(header.magic, "CPUTRACE", 8) != 0 || header.version != 5) {
+        printf("File [%s] is not a trace\n", argv[0]);
+        exit(1);
+    }
+
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mapping trace");
+        exit(1);
+    }
+    close(fd);
+
+    config.wide = header.wide;
+    config.msg_size = header.wide ? 4 : 2;
+    config.data_max = header.wide ? 0xFFFFFF : 255;
+    config.page_size = header.page_size;
+    config.banks = header.banks;
+    config.burst = header.burst;
+    config.routing = header.routing;
+    config.stream = header.stream;
+    config.zero_copy = header.zero_copy;
+    config.channels = header.channels;
+    config.window = header.window;
+    config.group = header.group;
+
+    if (channel < 0 || channel >= config.channels) {
+        printf("Channel [%d] must range from 0 to %d in this trace\n", channel, config.channels - 1);
+        exit(1);
+    }
+    int id = transfer ? CHANNEL_TRANSFER(channel) : CHANNEL_BUFFER(channel);
+
+    // the device reads and writes plain files, which never run dry
+    // until the end, where it sees EOF like a closed pipe
+    config.transport = TRANSPORT_PIPE;
+    config.wait = WAIT_SPIN;
+    config.batch = 0;
+
+    int input = memfd_create("replay input", 0);
+    int output = memfd_create("replay output", 0);
+    unsigned char *expected = malloc(st.st_size);
+    size_t expected_length = 0;
+    long messages = 0;
+
+    // split the trace into what the device was sent and what it sent
+    for (size_t at = sizeof header; at + sizeof (trace_record_t) <= (size_t) st.st_size; ) {
+        trace_record_t record;
+        memcpy(&record, map + at, sizeof record);
+
+        unsigned char *tail = (unsigned char *) map + at + sizeof record;
+        unsigned char buf[MSGSIZE_MAX];
+        convert_to_bytes(record.msg, buf);
+
+        if (delivered_to(&record, id)) {
+            if (write(input, buf, config.msg_size) != config.msg_size 
+                || write(input, tail, record.tail_length) != record.tail_length) {
+                perror("writing replay input");
+                exit(2);
+            }
+            messages++;
+        }
+        if (record.source == id) {
+            memcpy(expected + expected_length, buf, config.msg_size);
+            memcpy(expected + expected_length + config.msg_size, tail, record.tail_length);
+            expected_length += config.msg_size + record.tail_length;
+        }
+
+        at += (sizeof record + record.tail_length + 7) & ~(size_t) 7;
+    }
+
+    long wall = 0;
+
+    for (int run = 0; run < runs; run++) {
+        lseek(input, 0, SEEK_SET);
+        lseek(output, 0, SEEK_SET);
+        if (ftruncate(output, 0) == -1) {
+            perror("clearing replay output");
+            exit(2);
+        }
+
+        long start = now_ns();
+        pid_t pid = fork();
+
+        switch (pid) {
+            case -1:
+                exit(3);
+
+            // the device runs until the traced halt, or the end of input
+            case 0: {
+                map_slab();
+
+                channel_t from_bus = { .pipe = {input, -1} };
+                channel_t to_bus = { .pipe = {-1, output} };
+
+                if (transfer) 
+                    transfer_device(&to_bus, &from_bus, channel);
+                else 
+                    buffer(&to_bus, &from_bus, channel);
+                exit(0);
+            }
+
+            default:
+                break;
+        }
+
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("Replay run [%d] failed\n", run);
+            exit(1);
+        }
+        wall += now_ns() - start;
+    }
+
+    // compare what the last run sent with the trace
+    off_t output_length = lseek(output, 0, SEEK_END);
+    unsigned char *actual = malloc(output_length + 1);
+    if (pread(output, actual, output_length, 0) != output_length) {
+        perror("reading replay output");
+        exit(2);
+    }
+
+    size_t difference = 0;
+    while (difference < expected_length && difference < (size_t) output_length 
+           && expected[difference] == actual[difference]) {
+        difference++;
+    }
+    int match = (size_t) output_length == expected_length && difference == expected_length;
+
+    double seconds = wall / 1e9 / runs;
+    printf("{\"device\": \"%s\", \"runs\": %d, \"messages\": %ld, \"wall_s\": %.6f, "
+           "\"messages_per_s\": %.0f, \"match\": %s",
+           argv[1], runs, messages, seconds, messages / seconds, match ? "true" : "false");
+    if (!match) 
+        printf(", \"first_difference\": %zu", difference);
+    printf("}\n");
+
+    if (!match) 
+        exit(1);
+}
+
+// whether the bus passed a traced message on to the device 'id',
+// following the same rules as route_message and the halt
+int
+delivered_to (trace_record_t *record, int id) {
+    if (check_halt(record->msg)) 
+        return record->source == CPU_ID;
+    // the interrupt controller keeps these
+    if (get_id(record->msg) == BUS_ID || (get_id(record->msg) == CPU_ID && check_interrupt(record->msg))) 
+        return 0;
+    if (config.routing == ROUTE_BROADCAST) 
+        return 1;
+    if (get_id(record->msg) == BROADCAST_ID) 
+        return record->source != id;
+    return get_id(record->msg) == id;
+}
+
+// the counters live in shared memory mapped before the first fork,
+// so the bus can read every process's slot once they have all exited
+void
+map_counters (void) {
+    slots = mmap(NULL, COUNTER_SLOTS * sizeof (counters_t), PROT_READ | PROT_WRITE, 
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED) {
+        perror("mapping counters");
+        exit(2);
+    }
+
+    // every process stamps its own slot on the way out, 
+    // coroutines do when they finish
+    if (config.mode != MODE_ENGINE) 
+        atexit(stop_counters);
+}
+
+void
+attach_counters (counters_t *slot) {
+    counters = slot;
+    counters->started_ns = now_ns();
+}
+
+void
+stop_counters (void) {
+    counters->stopped_ns = now_ns();
+}
+
+// writes the counters of every process to stderr, as a table or JSON
+void
+dump_counters (void) {
+    const char *kinds[] = {"cpu", "bus", "io", "transfer", "buffer"};
+
+    if (config.dump == DUMP_TABLE) {
+        fprintf(stderr, "%-9s %10s %10s %8s %12s %8s %12s %12s %8s %8s %8s\n", 
+                "device", "sent", "received", "bursts", "empty_polls", "blocks", 
+                "blocked_ms", "working_ms", "raised", "acked", "states");
+    }
+    else {
+        fprintf(stderr, "{");
+    }
+
+    for (int i = 0; i < ID_LIMIT; i++) {
+        counters_t *c = &slots[i];
+
+        // with more than one channel, each device is named with its own
+        char name[16];
+        if (i < IO_DEVICE_ID || config.channels == 1) 
+            snprintf(name, sizeof name, "%s", kinds[i < IO_DEVICE_ID ? i : KIND_OF(i)]);
+        else 
+            snprintf(name, sizeof name, "%s%d", kinds[KIND_OF(i)], CHANNEL_OF(i));
+
+        double blocked_ms = c->blocked_ns / 1e6;
+        double working_ms = (c->stopped_ns - c->started_ns - c->blocked_ns) / 1e6;
+
+        if (config.dump == DUMP_TABLE) {
+            fprintf(stderr, "%-9s %10ld %10ld %8ld %12ld %8ld %12.3f %12.3f %8ld %8ld %8ld\n", 
+                    name, c->sent, c->received, c->bursts, c->empty_polls, c->blocks, 
+                    blocked_ms, working_ms, c->interrupts_raised, c->interrupts_acked, c->state_changes);
+        }
+        else {
+            fprintf(stderr, "%s\"%s\": {\"sent\": %ld, \"received\": %ld, \"bursts\": %ld, "
+                    "\"empty_polls\": %ld, \"blocks\": %ld, \"blocked_ms\": %.3f, \"working_ms\": %.3f, "
+                    "\"interrupts_raised\": %ld, \"interrupts_acked\": %ld, \"state_changes\": %ld}",
+                    i > 0 ? ", " : "", name, c->sent, c->received, c->bursts, c->empty_polls, 
+                    c->blocks, blocked_ms, working_ms, c->interrupts_raised, c->interrupts_acked, 
+                    c->state_changes);
+        }
+    }
+
+    // the bus dumps from inside the engine, so its clock is current
+    double real_ms = (now_ns() - slots[BUS_ID].started_ns) / 1e6;
+    double simulated_ms = config.virtual_time ? engine->clock / 1e6 : real_ms;
+
+    if (config.dump == DUMP_TABLE) 
+        fprintf(stderr, "simulated %.3f ms in %.3f ms\n", simulated_ms, real_ms);
+    else 
+        fprintf(stderr, ", \"simulated_ms\": %.3f, \"real_ms\": %.3f}\n", simulated_ms, real_ms);
+}
+
+// bench <runs> <lines> <line_length> [delay_min [delay_max]]
+// runs the whole system over a generated script and prints one JSON
+// object with the wall time, throughput and page round trip times.
+// lines are 'line_length' random letters, each followed by a newline
+// and, when delays are given, a 'd' line drawn from the range.
+void
+bench (int argc, char **argv) {
+    if (argc < 3 || argc > 5) {
+        printf("Bench needs <runs> <lines> <line_length> [delay_min [delay_max]]\n");
+        exit(1);
+    }
+
+    int runs = atoi(argv[0]);
+    int lines = atoi(argv[1]);
+    int line_length = atoi(argv[2]);
+    int delay_min = argc > 3 ? atoi(argv[3]) : -1;
+    int delay_max = argc > 4 ? atoi(argv[4]) : delay_min;
+
+    if (runs < 1 || lines < 0 || line_length < 0 || (argc > 3 && (delay_min < 0 || delay_max < delay_min))) {
+        printf("Bench needs runs >= 1, lines and line_length >= 0, and 0 <= delay_min <= delay_max\n");
+        exit(1);
+    }
+
+    long length = (long) lines * (line_length + 1);
+    if (length > INT_MAX) {
+        printf("Bench script of [%ld] characters is too long\n", length);
+        exit(1);
+    }
+
+    // the script is streamed, so its length needs no -W
+    config.stream = 1;
+
+    size_t size;
+    char *text = generate_script(lines, line_length, delay_min, delay_max, &size);
+
+    script_t script;
+    parse_script(text, size, &script);
+
+    // room for the round trip of every page in every run
+    int pages = (length + config.page_size - 1) / config.page_size;
+    size_t stats_size = sizeof (stats_t) + (size_t) pages * runs * sizeof (long);
+
+    stats = mmap(NULL, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mapping bench stats");
+        exit(2);
+    }
+    stats->capacity = pages * runs;
+
+    // the text itself is of no interest here
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (null_fd == -1) {
+        perror("opening /dev/null");
+        exit(1);
+    }
+
+    long wall = 0;
+
+    for (int run = 0; run < runs; run++) {
+        long start = now_ns();
+        pid_t pid = fork();
+
+        switch (pid) {
+            case -1:
+                exit(3);
+
+            // the child becomes the bus, the cpu and the devices
+            case 0: {
+                script_t *one = &script;
+                run_system(&one, 0, &null_fd);
+                stats->simulated_ns += simulated_ns;
+                exit(0);
+            }
+
+            default:
+                break;
+        }
+
+        int status;
+        if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("Bench run [%d] failed\n", run);
+            exit(1);
+        }
+        wall += now_ns() - start;
+    }
+
+    double seconds = wall / 1e9;
+    qsort(stats->rtt, stats->pages, sizeof (long), compare_long);
+
+    long p50 = 0, p90 = 0, p99 = 0, max = 0;
+    if (stats->pages > 0) {
+        p50 = stats->rtt[(stats->pages - 1) * 50 / 100];
+        p90 = stats->rtt[(stats->pages - 1) * 90 / 100];
+        p99 = stats->rtt[(stats->pages - 1) * 99 / 100];
+        max = stats->rtt[stats->pages - 1];
+    }
+
+    printf("{\"mode\": \"%s\", \"transport\": \"%s\", \"wait\": \"%s\", \"routing\": \"%s\", ",
+           config.mode == MODE_ENGINE ? "engine" : config.mode == MODE_THREAD ? "thread" : "process",
+           config.transport == TRANSPORT_RING ? "ring" : "pipe",
+           config.wait == WAIT_BLOCK ? "block" : "spin",
+           config.routing == ROUTE_ADDRESSED ? "addressed" : "broadcast");
+    printf("\"batch\": %d, \"burst\": %d, \"wide\": %d, \"page_size\": %d, \"banks\": %d, \"kernels\": \"%s\", ",
+           config.batch, config.burst, config.wide, config.page_size, config.banks, kernels.name);
+    printf("\"runs\": %d, \"lines\": %d, \"line_length\": %d, \"delay_min\": %d, \"delay_max\": %d, \"bytes\": %ld, ",
+           runs, lines, line_length, delay_min, delay_max, length);
+    printf("\"wall_s\": %.6f, \"simulated_s\": %.6f, \"bytes_per_s\": %.0f, \"messages_per_s\": %.0f, ",
+           seconds / runs, config.virtual_time ? stats->simulated_ns / 1e9 / runs : seconds / runs,
+           length * runs / seconds, stats->messages / seconds);
+    printf("\"page_rtt_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}}\n",
+           p50 / 1e3, p90 / 1e3, p99 / 1e3, max / 1e3);
+}
+
+// writes a script in the t/n/d format, with letters and delays from a
+// fixed seed so that runs compare across builds
+char *
+generate_script (int lines, int line_length, int delay_min, int delay_max, size_t *size) {
+    // "t " + text + "\n", "n\n", and "d " + up to 10 digits + "\n"
+    size_t line_max = line_length + 3 + 2 + 13;
+    char *text = malloc(lines * line_max + 1);
+    char *p = text;
+
+    srand(1);
+
+    for (int i = 0; i < lines; i++) {
+        if (line_length > 0) {
+            *p++ = 't';
+            *p++ = ' ';
+            for (int j = 0; j < line_length; j++) {
+                *p++ = 'a' + rand() % 26;
+            }
+            *p++ = '\n';
+        }
+
+        *p++ = 'n';
+        *p++ = '\n';
+
+        if (delay_min >= 0) 
+            p += sprintf(p, "d %d\n", delay_min + rand() % (delay_max - delay_min + 1));
+    }
+
+    *size = p - text;
+    return text;
+}
+
+long
+now_ns (void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void
+record_rtt (long ns) {
+    if (stats->pages < stats->capacity) 
+        stats->rtt[stats->pages++] = ns;
+}
+
+int
+compare_long (const void *a, const void *b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+// maps the script and parses it into ops, one per line:
+//   t <text>   send the text, without the newline
+//   n          send a newline
+//   d <ms>     wait before going on
+// blank lines are skipped, anything else is an error.
+void
+load_script (char *filename, script_t *script) {
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("opening script");
+        exit(1);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("reading script");
+        exit(1);
+    }
+
+    // nothing to map, and nothing to send
+    if (st.st_size == 0) {
+        close(fd);
+        parse_script("", 0, script);
+        return;
+    }
+
+    // the text ops point into this mapping, so it stays for good
+    char *file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (file == MAP_FAILED) {
+        perror("mapping script");
+        exit(1);
+    }
+    close(fd);
+
+    parse_script(file, st.st_size, script);
+    script->file = file;
+    script->file_size = st.st_size;
+}
+
+void
+unload_script (script_t *script) {
+    if (script->file != NULL) 
+        munmap(script->file, script->file_size);
+    free(script->ops);
+}
+
+void
+parse_script (const char *file, size_t size, script_t *script) {
+    script->ops = NULL;
+    script->count = 0;
+    script->size = 0;
+    script->chars = 0;
+    script->file = NULL;
+    script->file_size = 0;
+
+    const char *end = file + size;
+    int line = 1;
+
+    for (const char *p = file; p < end; line++) {
+        const char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL) 
+            eol = end;
+
+        switch (*p) {
+            case '\n':
+                break;
+
+            case 't':
+                // the text starts after the space that follows the 't'
+                if (eol - p > 2) 
+                    add_op(script, OP_TEXT, eol - p - 2, p + 2);
+                break;
+
+            case 'n':
+                add_op(script, OP_NEWLINE, 0, NULL);
+                break;
+
+            case 'd': {
+                char *number_end;
+                long wait_time = strtol(p + 1, &number_end, 10);
+
+                if (number_end == p + 1 || number_end > eol || wait_time < 0 || wait_time > INT_MAX / 1000) {
+                    printf("Line [%d] of the script needs a delay in milliseconds\n", line);
+                    exit(1);
+                }
+
+                add_op(script, OP_DELAY, wait_time, NULL);
+                break;
+            }
+
+            default:
+                printf("Line [%d] of the script starts with [%c], not t, n or d\n", line, *p);
+                exit(1);
+        }
+
+        p = eol + 1;
+    }
+}
+
+void
+add_op (script_t *script, int type, int length, const char *text) {
+    // grow by doubling, a multi megabyte script parses in one pass
+    if (script->count == script->size) {
+        script->size = script->size == 0 ? 16 : script->size * 2;
+        script->ops = realloc(script->ops, script->size * sizeof (op_t));
+        if (script->ops == NULL) {
+            perror("loading script");
+            exit(1);
+        }
+    }
+
+    script->ops[script->count].type = type;
+    script->ops[script->count].length = length;
+    script->ops[script->count].text = text;
+    script->count++;
+
+    if (type == OP_TEXT) 
+        script->chars += length;
+    else if (type == OP_NEWLINE) 
+        script->chars++;
+}
+
+// copies text from op 'op', byte 'position', into 'page' after the 
+// first 'filled' bytes, until it holds 'size' or a delay comes up. 
+// returns the bytes in the page, with 'op' and 'position' moved past 
+// the text that was taken.
+int
+fill_page (script_t *script, int *op, int *position, char *page, int filled, int size) {
+    while (filled < size && *op < script->count) {
+        op_t *current = &script->ops[*op];
+
+        if (current->type == OP_DELAY) 
+            break;
+
+        if (current->type == OP_NEWLINE) {
+            page[filled++] = '\n';
+            (*op)++;
+            continue;
+        }
+
+        int n = current->length - *position;
+        if (n > size - filled) 
+            n = size - filled;
+
+        memcpy(page + filled, current->text + *position, n);
+        filled += n;
+        *position += n;
+
+        if (*position == current->length) {
+            (*op)++;
+            *position = 0;
+        }
+    }
+
+    return filled;
+}
+
+//  protocol for communication between transfer device and IO device:
+//  transfer sends IO a msg 
+//  if data == 1
+//      then the IO should send back the next character 
+//      via a msg with that character as the data
+
+void 
+transfer_device (channel_t *tran_bus, channel_t *bus_tran, int channel) {
+    int MAX_LENGTH = config.page_size;
+
+    message_t msg = 0;
+    int length_has_been_read = 0;
+    int length_messages = config.wide ? 1 : 2;
+    int length = 0;
+    int index = 0;
+    int ended = 0;
+    int exhausted = 0;  // the io device has said there is no more
+    int filling = 0;    // the slot the io device is filling, with -z
+
+    // requests to the io device not answered yet, and the characters
+    // they asked for. with -z every answer is a page, so one is asked 
+    // for at a time.
+    int asked = 0;
+    int promised = 0;
+    int window = config.zero_copy ? 1 : config.window;
+    int *wants = run_alloc(window * sizeof (int));
+    int first = 0;
+
+    // banks filled and not yet acknowledged by the cpu. once all of
+    // them are full the transfer device stalls until an ack frees one.
+    int full = 0;
+    int done = 0;
+
+    // when each full bank was raised, for the bench's round trip times
+    long *raised = run_alloc(config.banks * sizeof (long));
+    int oldest = 0;
+
+    // with -z, the slot held by each full bank until its ack
+    int *held = run_alloc(config.banks * sizeof (int));
+
+    // with bursts, a page is collected here and stored in one go
+    unsigned char *page = (unsigned char *) slab_page(SLOT_TRANSFER(channel));
+
+    unsigned char classes[256];
+    classify(classes, CHANNEL_TRANSFER(channel));
+
+    close_read_end(tran_bus); // close read end of bus_io
+    close_write_end(bus_tran); // close write end of io_bus
+
+    // a stream has no length to wait for, the characters come until
+    // the io device says there are no more
+    if (config.stream) {
+        length_has_been_read = length_messages;
+    }
+
+    while (1) {
+        // keep up to the window of characters asked for, as long as 
+        // the page being filled has room for them, a bank is free to 
+        // hold it, and the text goes on
+        while (length_has_been_read == length_messages && !exhausted && asked < window 
+               && full < config.banks && (config.zero_copy || index + promised < MAX_LENGTH) 
+               && (config.stream || promised < length)) {
+            int want = config.group;
+            if (!config.zero_copy && want > MAX_LENGTH - index - promised) 
+                want = MAX_LENGTH - index - promised;
+            if (!config.stream && want > length - promised) 
+                want = length - promised;
+
+            filling = request_text(tran_bus, channel, want);
+            wants[(first + asked) % window] = want;
+            promised += want;
+            asked++;
+        }
+
+
+        int took = 0;   // a character was taken in this pass
+
+        msg = await_message(bus_tran, tran_bus);
+
+        int class = classes[get_control(msg)];
+        if (msg == 0 || class == CLASS_OTHER) 
+            continue;
+
+        if (class == CLASS_HALT) {
+            finish();
+        }
+
+        if (class == CLASS_INTERRUPT && get_data(msg) == INT_END_OF_STREAM) {
+            counters->interrupts_acked++;
+            ended = 1;
+            exhausted = 1;
+
+            // the slot asked for was never filled
+            if (config.zero_copy) 
+                slab_give(channel, filling);
+        }
+        else if (class == CLASS_INTERRUPT) {
+            // acknowledge from the CPU, the oldest bank is free again
+            counters->interrupts_acked++;
+            if (stats != NULL) 
+                record_rtt(now_ns() - raised[oldest]);
+            if (config.zero_copy) 
+                slab_give(channel, held[oldest]);
+            oldest = (oldest + 1) % config.banks;
+            full--;
+        }
+        // read the length passed by 2 messages, high byte first,
+        // or by a single wide message
+        else if (length_has_been_read < length_messages) {
+            length = (length << 8) + get_data(msg);
+            length_has_been_read++;
+
+            if (length_has_been_read == length_messages && length == 0) {
+                done = 1;
+            }
+        } 
+        else if (config.zero_copy) {
+            // a page the io device filled in the pool. past the 
+            // length, the text is not wanted.
+            index = get_data(msg);
+            if (!config.stream && index > length) 
+                index = length;
+            if (!config.stream) 
+                length -= index;
+            promised -= wants[first];
+            first = (first + 1) % window;
+            asked--;
+            took = 1;
+        }
+        else {
+            // up to as many characters as were asked for, low byte first
+            unsigned int data = get_data(msg);
+
+            for (int n = 0; n < wants[first] && (n == 0 || data != 0); n++) {
+                char character = data & 0xFF;
+                data >>= 8;
+
+                if (config.burst) {
+                    page[index] = character;
+                }
+                else {
+                    // send a chain of messages to the buffer to 
+                    // store 'character' at address 'index'
+                    message_t msg1 = MSG_DATA(CHANNEL_BUFFER(channel), MODE_WRITE);
+                    write_message(tran_bus, msg1);
+
+                    message_t msg2 = MSG_DATA(CHANNEL_BUFFER(channel), index);
+                    write_message(tran_bus, msg2);
+
+                    message_t msg3 = MSG_DATA(CHANNEL_BUFFER(channel), (unsigned char) character);
+                    write_message(tran_bus, msg3);
+                }
+
+                index++;
+                if (!config.stream) 
+                    length--;
+            }
+
+            promised -= wants[first];
+            first = (first + 1) % window;
+            asked--;
+            took = 1;
+        }
+
+        // a full page, the last characters, or what a stream left in 
+        // the page when it ended: store the page and tell the CPU to 
+        // read it from the BUFFER
+        if (index == MAX_LENGTH || (index > 0 && ((!config.stream && length == 0) || ended || config.zero_copy))) {
+            // with -z the burst names the slot instead of an address
+            if (config.zero_copy) {
+                write_burst(tran_bus, CHANNEL_BUFFER(channel), MODE_BURST_WRITE, filling, index, NULL);
+                held[(oldest + full) % config.banks] = filling;
+            }
+            else if (config.burst) {
+                write_burst(tran_bus, CHANNEL_BUFFER(channel), MODE_BURST_WRITE, 0, index, page);
+            }
+
+            message_t msg6 = MSG_INTERRUPT(CPU_ID, INT_VECTOR(INT_PAGE_FULL, channel));
+            write_message(tran_bus, msg6);
+            counters->interrupts_raised++;
+
+            if (stats != NULL) 
+                raised[(oldest + full) % config.banks] = now_ns();
+            full++;
+            index = 0;
+        }
+
+        if (ended) {
+            done = 1;
+            ended = 0;
+        }
+        else if (took && !config.stream && length == 0) {
+            done = 1;
+        }
+
+        // once the CPU has read every page back, send the CPU a 
+        // message telling it the data has been read to buffer
+        if (done && full == 0) {
+            message_t msg5 = MSG_INTERRUPT(CPU_ID, INT_VECTOR(INT_DONE, channel));
+            write_message(tran_bus, msg5);
+            counters->interrupts_raised++;
+            done = 0;
+        }
+    }
+}
+
+// asks the io device for up to 'want' characters, or with -z for a 
+// page of text in a slot taken from the slab. returns the slot.
+int
+request_text (channel_t *tran_bus, int channel, int want) {
+    int slot = config.zero_copy ? slab_take(channel) : want;
+
+    message_t msg = MSG_DATA(CHANNEL_IO(channel), slot);
+    write_message(tran_bus, msg);
+    return slot;
+}
+
+// a device with nothing left to do still reads its link until the 
+// halt: with broadcast routing the bus goes on copying every message
+// to it, and a link nobody reads fills up and stops the bus
+void
+await_halt (channel_t *in, channel_t *out) {
+    while (1) {
+        message_t msg = await_message(in, out);
+        if (msg != 0 && check_halt(msg)) 
+            finish();
+    }
+}
+
+// asks the channel's buffer for the byte at 'address'
+void
+read_byte (channel_t *cpu_bus, int channel, int address) {
+    message_t msg = MSG_DATA(CHANNEL_BUFFER(channel), MODE_READ);
+    write_message(cpu_bus, msg);
+
+    msg = MSG_DATA(CHANNEL_BUFFER(channel), address);
+    write_message(cpu_bus, msg);
+}
+
+void 
+buffer (channel_t *buf_bus, channel_t *bus_buf, int channel) {
+    message_t msg = 0;
+
+    close_read_end(buf_bus); // close read end of bus_io
+    close_write_end(bus_buf); // close write end of io_bus
+
+    // the banks are filled and drained in the same round robin order,
+    // so a burst only has to give the address within its bank
+    char *buf = slab_page(SLOT_BANK(channel, 0));
+    int write_bank = 0;
+    int read_bank = 0;
+
+    // with -z a bank is a slot passed on by the transfer device, and 
+    // only its index and length are held here
+    int *held = run_alloc(config.banks * sizeof (int));
+    int *lengths = run_alloc(config.banks * sizeof (int));
+
+    // the end of what was written to each bank, so draining it clears
+    // no more than that. text may hold an empty byte, so the first one
+    // is not where the writes stopped
+    int *written = run_alloc(config.banks * sizeof (int));
+
+    int mode = -1;
+    int address = 0;
+    int data = 0;
+
+    int curr_state = STATE_MODE;
+
+    unsigned char classes[256];
+    classify(classes, CHANNEL_BUFFER(channel));
+
+    while (1) {
+        msg = await_message(bus_buf, buf_bus);
+
+        if (msg != 0) {
+            int class = classes[get_control(msg)];
+            if (class != CLASS_OTHER) {
+                if (class == CLASS_HALT) {
+                    //printf("==== BUFFER HAS HALTED ====\n");
+                    finish();
+                }
+                if (class == CLASS_BURST) {
+                    int length = receive_descriptor(bus_buf, buf_bus, &address);
+
+                    if ((config.zero_copy ? 0 : address) + length > config.page_size) {
+                        printf("Burst [%d + %d] does not fit in the buffer\n", address, length);
+                        exit(1);
+                    }
+
+                    if (get_data(msg) == MODE_BURST_WRITE && config.zero_copy) {
+                        held[write_bank] = address;
+                        lengths[write_bank] = length;
+                        write_bank = (write_bank + 1) % config.banks;
+                    }
+                    else if (get_data(msg) == MODE_BURST_READ && config.zero_copy) {
+                        int valid = lengths[read_bank] < length ? lengths[read_bank] : length;
+                        write_burst(buf_bus, CPU_ID, MODE_BURST_DATA, held[read_bank], valid, NULL);
+                        read_bank = (read_bank + 1) % config.banks;
+                    }
+                    else if (get_data(msg) == MODE_BURST_WRITE) {
+                        buf = slab_page(SLOT_BANK(channel, write_bank));
+
+                        receive_bytes(bus_buf, buf_bus, (unsigned char *) buf + address, length);
+                        if (address + length > written[write_bank]) 
+                            written[write_bank] = address + length;
+                        write_bank = (write_bank + 1) % config.banks;
+                    }
+                    else if (get_data(msg) == MODE_BURST_READ) {
+                        buf = slab_page(SLOT_BANK(channel, read_bank));
+
+                        // answer with the text up to the first empty byte
+                        int valid = kernels.scan(buf + address, length);
+
+                        write_burst(buf_bus, CPU_ID, MODE_BURST_DATA, address, valid, (unsigned char *) buf + address);
+                        kernels.zero(buf, written[read_bank]);
+                        written[read_bank] = 0;
+                        read_bank = (read_bank + 1) % config.banks;
+                    }
+
+                    address = 0;
+                }
+                else if (curr_state == STATE_MODE) {
+                    mode = get_data(msg);
+
+                    curr_state = STATE_ADDRESS;
+                    counters->state_changes++;
+                }
+                else if (curr_state == STATE_ADDRESS) {
+                    address = get_data(msg);
+
+                    if (mode == MODE_WRITE) {
+                        curr_state = STATE_DATA;
+                        counters->state_changes++;
+                    }
+                    else if (mode == MODE_READ) {
+                        data = buf[address];
+
+                        //printf("============ BUFFER SENDING ['%c' @ %d] ============\n", data, address);
+                        message_t msg1 = MSG_DATA(CPU_ID, (unsigned char) data);
+                        write_message(buf_bus, msg1);
+
+                        if (address == config.page_size - 1 || data == 0) {
+                            message_t msg9 = MSG_INTERRUPT(CPU_ID, INT_VECTOR(INT_READ_DONE, channel));
+                            write_message(buf_bus, msg9);
+                            counters->interrupts_raised++;
+                            // per byte, there is only the one bank
+                            kernels.zero(buf, written[0]);
+                            written[0] = 0;
+                        }
+
+                        mode = -1;
+                        address = 0;
+                        data = 0;
+
+                        curr_state = STATE_MODE;
+                        counters->state_changes++;
+                    }
+                }
+                else if (curr_state == STATE_DATA) {
+                    data = get_data(msg);
+
+                    //printf("==== STORED ['%c'] IN BUFFER ====\n", data);
+                    buf[address] = data;
+                    if (address + 1 > written[0]) 
+                        written[0] = address + 1;
+                    mode = -1;
+                    address = 0;
+                    data = 0;
+
+                    curr_state = STATE_MODE;
+                    counters->state_changes++;
+                }
+            }
+        }
+    }
+}
+
+// map 'count' rings into memory shared by every process forked afterwards
+void
+map_rings (int count) {
+    ring_pool = mmap(NULL, count * sizeof (ring_t), PROT_READ | PROT_WRITE, 
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring_pool == MAP_FAILED) {
+        perror("mapping rings");
+        exit(1);
+    }
+    ring_pool_used = 0;
+    ring_pool_size = count;
+}
+
+void
+open_channel (channel_t *ch) {
+    ch->ring = NULL;
+    ch->pipe[0] = -1;
+    ch->pipe[1] = -1;
+
+    if (config.transport == TRANSPORT_RING) {
+        if (ring_pool_used == ring_pool_size) {
+            printf("Ran out of rings [%d]\n", ring_pool_size);
+            exit(1);
+        }
+        ch->ring = &ring_pool[ring_pool_used++];
+        ch->out_length = 0;
+        ch->in_start = 0;
+        ch->in_length = 0;
+        atomic_init(&ch->ring->head, 0);
+        atomic_init(&ch->ring->tail, 0);
+        atomic_init(&ch->ring->bell.seq, 0);
+        atomic_init(&ch->ring->bell.sleepers, 0);
+        ch->ring->wake = &ch->ring->bell;
+        return;
+    }
+
+    ch->out_length = 0;
+    ch->in_start = 0;
+    ch->in_length = 0;
+
+    // error checking for pipe 
+    if (pipe(ch->pipe) < 0) 
+        exit(1); 
+  
+    // Set the pipe to non-blocking
+    if (fcntl(ch->pipe[0], F_SETFL, O_NONBLOCK) < 0) 
+        exit(2); 
+}
+
+// make the producer of ch wake whoever sleeps on the ring of 'with', 
+// so that one reader can sleep on many rings at once. has to be 
+// called before the producer of ch is forked.
+void
+share_doorbell (channel_t *ch, channel_t *with) {
+    if (ch->ring != NULL) 
+        ch->ring->wake = with->ring->wake;
+}
+
+void
+close_read_end (channel_t *ch) {
+    if (ch->ring == NULL) 
+        close(ch->pipe[0]);
+}
+
+void
+close_write_end (channel_t *ch) {
+    if (ch->ring == NULL) 
+        close(ch->pipe[1]);
+}
+
+// copy at least 'least' and at most 'most' bytes out of the ring, or
+// nothing at all if fewer than 'least' are available. returns the 
+// number of bytes read.
+int
+ring_read (ring_t *ring, unsigned char *buf, int least, int most) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    unsigned int count = tail - head;
+
+    if (count < (unsigned int) least) 
+        return 0;
+    if (count > (unsigned int) most) 
+        count = most;
+
+    // messages are a few bytes, cheaper copied in line than through
+    // a kernel; bursts go in at most two pieces, up to the end of the
+    // ring and from its start
+    if (count < KERNEL_MIN) {
+        for (unsigned int i = 0; i < count; i++) {
+            buf[i] = ring->data[(head + i) % RING_SIZE];
+        }
+    }
+    else {
+        unsigned int start = head % RING_SIZE;
+        unsigned int first = count < RING_SIZE - start ? count : RING_SIZE - start;
+        kernels.copy(buf, ring->data + start, first);
+        kernels.copy(buf + first, ring->data, count - first);
+    }
+
+    atomic_store_explicit(&ring->head, head + count, memory_order_release);
+    return count;
+}
+
+// copy 'count' bytes into the ring, yielding while the consumer 
+// frees up enough room (a full pipe would block the writer as well).
+// a page can outgrow the ring, so that is copied over in pieces.
+void
+ring_write (ring_t *ring, unsigned char *buf, int count) {
+    while (count > RING_SIZE) {
+        ring_write(ring, buf, RING_SIZE);
+        buf += RING_SIZE;
+        count -= RING_SIZE;
+    }
+
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    while (RING_SIZE - (tail - atomic_load_explicit(&ring->head, memory_order_acquire)) < (unsigned int) count) {
+        if (config.mode == MODE_ENGINE) 
+            engine_wait_room(ring, count);
+        else 
+            sched_yield();
+    }
+
+    if (count < KERNEL_MIN) {
+        for (int i = 0; i < count; i++) {
+            ring->data[(tail + i) % RING_SIZE] = buf[i];
+        }
+    }
+    else {
+        unsigned int start = tail % RING_SIZE;
+        int first = count < (int) (RING_SIZE - start) ? count : (int) (RING_SIZE - start);
+        kernels.copy(ring->data + start, buf, first);
+        kernels.copy(ring->data, buf + first, count - first);
+    }
+
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+
+    // the reader checks for data only after reading seq, so bumping it
+    // after the write means it either sees the data or fails the futex wait
+    atomic_fetch_add(&ring->wake->seq, 1);
+    if (atomic_load(&ring->wake->sleepers) > 0) 
+        syscall(SYS_futex, &ring->wake->seq, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// block until at least one of the channels has a message to read.
+// pipes sleep in poll, or in epoll_fd when one is given for many pipes,
+// rings sleep on the futex of their shared doorbell.
+void
+wait_for_channels (channel_t *in[], int count, int epoll_fd) {
+    // a frame read earlier may still hold messages
+    for (int i = 0; i < count; i++) {
+        if (in[i]->in_length - in[i]->in_start >= config.msg_size) 
+            return;
+    }
+
+    if (config.mode == MODE_ENGINE) {
+        engine_wait(in, count);
+        return;
+    }
+
+    if (in[0]->ring != NULL) {
+        doorbell_t *bell = in[0]->ring->wake;
+        unsigned int seq = atomic_load(&bell->seq);
+
+        for (int i = 0; i < count; i++) {
+            ring_t *ring = in[i]->ring;
+            if (atomic_load(&ring->tail) != atomic_load(&ring->head)) 
+                return;
+        }
+
+        long slept = now_ns();
+        atomic_fetch_add(&bell->sleepers, 1);
+        syscall(SYS_futex, &bell->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+        atomic_fetch_sub(&bell->sleepers, 1);
+        counters->blocks++;
+        counters->blocked_ns += now_ns() - slept;
+        return;
+    }
+
+    long slept = now_ns();
+    counters->blocks++;
+
+    if (epoll_fd >= 0) {
+        struct epoll_event events[4];
+        if (epoll_wait(epoll_fd, events, 4, -1) < 0 && errno != EINTR) {
+            perror("waiting on epoll");
+            exit(4);
+        }
+    }
+    else {
+        struct pollfd pfd = {.fd = in[0]->pipe[0], .events = POLLIN};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+            perror("waiting on pipe");
+            exit(4);
+        }
+    }
+
+    counters->blocked_ns += now_ns() - slept;
+}
+
+// read between 'least' and 'most' bytes from the channel, returning 0
+// when it is empty. pipes cannot be asked for a minimum, but every
+// writer sends whole messages so a read never splits one.
+int
+read_channel (channel_t *in, channel_t *out, unsigned char *buf, int least, int most) {
+    int nread;
+
+    if (in->ring != NULL) {
+        // an empty ring is the same as an empty pipe
+        nread = ring_read(in->ring, buf, least, most);
+        if (nread == 0) 
+            counters->empty_polls++;
+        return nread;
+    }
+
+    nread = read(in->pipe[0], buf, most);
+    switch (nread) {
+        // case -1 means pipe is empty and errno set EAGAIN
+        case -1:
+            if (errno == EAGAIN) {
+                //printf("  (pipe empty)\n");
+                counters->empty_polls++;
+                break;
+            }
+            else {
+                perror("recieving message from pipe");
+                exit(4);
+            }
+
+        
+        // case 0 means that all the bytes have been read, 
+        // EOF has been reached
+        case 0:
+            close_read_end(in);
+            close_write_end(out);
+            finish();
+        
+
+        default:
+            return nread;
+    }
+
+    return 0;
+}
+
+message_t
+receive_message (channel_t *in, channel_t *out) {
+    unsigned char buf[MSGSIZE_MAX];
+
+    if (!config.batch) {
+        if (read_channel(in, out, buf, config.msg_size, config.msg_size) == 0) 
+            return 0;
+        counters->received++;
+        return convert_to_message(buf);
+    }
+
+    // whatever this process queued for the other side must go out 
+    // before it looks for (and maybe waits on) the reply
+    flush_channel(out);
+
+    if (in->in_length - in->in_start < config.msg_size) {
+        // keep any partial message and refill the frame behind it
+        in->in_length -= in->in_start;
+        memmove(in->in, in->in + in->in_start, in->in_length);
+        in->in_start = 0;
+
+        in->in_length += read_channel(in, out, in->in + in->in_length, 1, FRAME_SIZE - in->in_length);
+        if (in->in_length < config.msg_size) 
+            return 0;
+    }
+
+    message_t msg = convert_to_message(in->in + in->in_start);
+    in->in_start += config.msg_size;
+    counters->received++;
+    return msg;
+}
+
+// read exactly 'count' bytes, such as the rest of a burst, waiting for
+// them if the sender has not finished writing yet
+void
+receive_bytes (channel_t *in, channel_t *out, unsigned char *buf, int count) {
+    int got = 0;
+
+    while (got < count) {
+        // take what is left of the last frame first
+        int have = in->in_length - in->in_start;
+        if (have > 0) {
+            int n = have < count - got ? have : count - got;
+            kernels.copy(buf + got, in->in + in->in_start, n);
+            in->in_start += n;
+            got += n;
+            continue;
+        }
+
+        int n = read_channel(in, out, buf + got, 1, count - got);
+        got += n;
+
+        if (n == 0 && config.wait == WAIT_BLOCK) 
+            wait_for_channels(&in, 1, -1);
+    }
+}
+
+// same as receive_message, but with -w block sleeps until a message
+// arrives instead of returning 0 on an empty channel
+message_t
+await_message (channel_t *in, channel_t *out) {
+    message_t msg = receive_message(in, out);
+
+    while (msg == 0 && config.wait == WAIT_BLOCK) {
+        wait_for_channels(&in, 1, -1);
+        msg = receive_message(in, out);
+    }
+
+    return msg;
+}
+
+
+// A message is comprised of the following:
+// bit  | description
+// ========================================
+// 0    | interrupt signal
+// 1    | carrying data
+// 2    | halt?
+// 3-7  | ID of device to receive message
+// 8-15 | data
+//
+// With -W a message is 32 bits instead, and bits 8-31 hold the data.
+// In memory a message_t always keeps the control byte (bits 0-7) in 
+// its top byte and the data in the low 24 bits; only the bytes on 
+// the wire differ.
+//
+// ID # | device
+// ===================
+//   0  | CPU
+//   1  | Bus
+//   2  | IO
+//   3  | Transfer 
+//   4  | Buffer
+//  5+  | IO, Transfer and Buffer of channel 1 and on, with -n
+//  31  | Broadcast
+//
+// checks every field, for values from outside such as the number
+message_t
+create_message (int is, int cd, int halt, int id, int data) {
+    if (is > 1 || is < 0) {
+        printf("Interrupt Signal Bit [%d] must range from 0 to 1", is);
+        exit(1);
+    }
+
+    if (cd > 1 || cd < 0) {
+        printf("Carry Data Bit [%d] must range from 0 to 1", cd);
+        exit(1);
+    }
+
+    if (halt > 1 || halt < 0) {
+        printf("Halt Bit must [%d] range form 0 to 1", halt);
+        exit(1);
+    }
+
+    if ((id >= ID_LIMIT && id != BROADCAST_ID) || id < 0) {
+        printf("ID must range [%d] from 0 to %d, or be %d", id, ID_LIMIT - 1, BROADCAST_ID);
+        exit(1);
+    }
+
+    if (data > config.data_max || data < 0) {
+        printf("Data [%d] must range from 0 to %d.", data, config.data_max);
+        exit(1);
+    }
+
+    return MSG(is, cd, halt, id, data);
+}
+
+message_t
+convert_to_message (unsigned char buf[]) {
+    message_t msg = 0;
+    msg += (message_t) buf[0] << 24;
+    if (config.wide) {
+        msg += buf[1] << 16;
+        msg += buf[2] << 8;
+        msg += buf[3];
+    }
+    else {
+        msg += buf[1];
+    }
+    return msg;
+}
+
+void
+convert_to_bytes (message_t msg, unsigned char buf[]) {
+    buf[0] = (unsigned char) (msg >> 24);
+    if (config.wide) {
+        buf[1] = (unsigned char) (msg >> 16);
+        buf[2] = (unsigned char) (msg >> 8);
+        buf[3] = (unsigned char) msg;
+    }
+    else {
+        buf[1] = (unsigned char) msg;
+    }
+}
+
+// the cpu writes the text to stdout, or to the file opened for -o
+void
+open_sink (sink_t *sink, int fd) {
+    sink->fd = fd;
+    sink->size = config.sink_size;
+    sink->buf = sink->size > 0 ? run_alloc(sink->size) : NULL;
+    sink->length = 0;
+}
+
+// gather 'data' in the sink. when it would overflow, what is gathered
+// and 'data' go out together in one writev, without copying 'data'.
+void
+sink_write (sink_t *sink, char *data, int count) {
+    if (sink->length + count <= sink->size) {
+        kernels.copy(sink->buf + sink->length, data, count);
+        sink->length += count;
+        return;
+    }
+
+    struct iovec iov[2] = {
+        { .iov_base = sink->buf, .iov_len = sink->length },
+        { .iov_base = data, .iov_len = count },
+    };
+    write_all(sink->fd, iov, 2);
+    sink->length = 0;
+}
+
+void
+flush_sink (sink_t *sink) {
+    struct iovec iov = { .iov_base = sink->buf, .iov_len = sink->length };
+    write_all(sink->fd, &iov, 1);
+    sink->length = 0;
+}
+
+// writev until every byte is out, picking up after short writes
+void
+write_all (int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t nwritten = writev(fd, iov, count);
+        if (nwritten == -1) {
+            if (errno == EINTR) 
+                continue;
+            perror("writing output");
+            exit(4);
+        }
+
+        while (count > 0 && (size_t) nwritten >= iov->iov_len) {
+            nwritten -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *) iov->iov_base + nwritten;
+            iov->iov_len -= nwritten;
+        }
+    }
+}
+
+// the widest kernels the cpu supports, the scalar ones elsewhere.
+// every kernel stays inside [0, length), so a page can end anywhere
+void
+pick_kernels (void) {
+    kernels = (kernels_t) { "scalar", scan_scalar, copy_scalar, zero_scalar };
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) 
+        kernels = (kernels_t) { "avx2", scan_avx2, copy_avx2, zero_avx2 };
+    else if (__builtin_cpu_supports("sse2")) 
+        kernels = (kernels_t) { "sse2", scan_sse2, copy_sse2, zero_sse2 };
+#endif
+}
+
+// the offset of the first empty byte, or length if there is none
+int
+scan_scalar (const char *page, int length) {
+    int i = 0;
+    while (i < length && page[i] != 0) {
+        i++;
+    }
+    return i;
+}
+
+void
+copy_scalar (void *to, const void *from, int length) {
+    memcpy(to, from, length);
+}
+
+void
+zero_scalar (void *page, int length) {
+    memset(page, 0, length);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// compare 16 bytes at a time against zero, the lowest set bit of the
+// mask is the first empty byte
+int
+scan_sse2 (const char *page, int length) {
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) (page + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+        if (mask != 0) 
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_scalar(page + i, length - i);
+}
+
+void
+copy_sse2 (void *to, const void *from, int length) {
+    int i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *) ((const char *) from + i));
+        _mm_storeu_si128((__m128i *) ((char *) to + i), block);
+    }
+    memcpy((char *) to + i, (const char *) from + i, length - i);
+}
+
+void
+zero_sse2 (void *page, int length) {
+    __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        _mm_storeu_si128((__m128i *) ((char *) page + i), zero);
+    }
+    memset((char *) page + i, 0, length - i);
+}
+
+int
+scan_avx2 (const char *page, int length) {
+    __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) (page + i));
+        unsigned int mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero));
+        if (mask != 0) 
+            return i + __builtin_ctz(mask);
+    }
+    return i + scan_sse2(page + i, length - i);
+}
+
+void
+copy_avx2 (void *to, const void *from, int length) {
+    int i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *) ((const char *) from + i));
+        _mm256_storeu_si256((__m256i *) ((char *) to + i), block);
+    }
+    copy_sse2((char *) to + i, (const char *) from + i, length - i);
+}
+
+void
+zero_avx2 (void *page, int length) {
+    __m256i zero = _mm256_setzero_si256();
+    int i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        _mm256_storeu_si256((__m256i *) ((char *) page + i), zero);
+    }
+    zero_sse2((char *) page + i, length - i);
+}
+#endif
+
+// A burst moves a block of bytes as a single frame:
+// part     | description
+// ========================================
+// header   | no flag bits set, ID of the receiver, data is the mode
+// address  | data message holding the start address
+// length   | data message holding the number of bytes
+// payload  | 'length' raw bytes, for MODE_BURST_WRITE and MODE_BURST_DATA
+void
+write_burst (channel_t *ch, int id, int mode, int address, int length, unsigned char *payload) {
+    unsigned char descriptor[3 * MSGSIZE_MAX];
+    int size = config.msg_size;
+
+    convert_to_bytes(MSG_BURST(id, mode), descriptor);
+    convert_to_bytes(MSG_DATA(id, address), descriptor + size);
+    convert_to_bytes(MSG_DATA(id, length), descriptor + 2 * size);
+    write_bytes(ch, descriptor, 3 * size);
+
+    // the payload follows on the same channel, and every channel has a
+    // single writer, so nothing can come between the two writes
+    if (burst_has_payload(mode) && length > 0) 
+        write_bytes(ch, payload, length);
+
+    counters->bursts++;
+}
+
+// read the address and length that follow a burst header, 
+// returning the length. any payload is left for the caller.
+int
+receive_descriptor (channel_t *in, channel_t *out, int *address) {
+    unsigned char buf[2 * MSGSIZE_MAX];
+
+    receive_bytes(in, out, buf, 2 * config.msg_size);
+    *address = get_data(convert_to_message(buf));
+    return get_data(convert_to_message(buf + config.msg_size));
+}
+
+// read the rest of a burst into 'frame' as raw bytes, header included,
+// so the bus can pass it on untouched. returns the size of the frame.
+int
+receive_frame (channel_t *in, channel_t *out, message_t header, unsigned char *frame) {
+    int size = config.msg_size;
+    int frame_length = 3 * size;
+
+    convert_to_bytes(header, frame);
+    receive_bytes(in, out, frame + size, 2 * size);
+
+    if (burst_has_payload(get_data(header))) {
+        int length = get_data(convert_to_message(frame + 2 * size));
+        if (length > config.page_size) {
+            printf("Burst [%d] is longer than a page\n", length);
+            exit(1);
+        }
+
+        receive_bytes(in, out, frame + frame_length, length);
+        frame_length += length;
+    }
+
+    return frame_length;
+}
+
+int
+burst_has_payload (int mode) {
+    // with -z the page is already in the slab
+    if (config.zero_copy) 
+        return 0;
+    return mode == MODE_BURST_WRITE || mode == MODE_BURST_DATA;
+}
+
+// maps the slots for one system, before anything is started. with -z
+// the bank slots start out free.
+void
+map_slab (void) {
+    int count = SLOT_TRANSFER(config.channels);
+    long page = sysconf(_SC_PAGESIZE);
+    size_t pages = (sizeof (slab_t) + config.channels * config.banks * sizeof (int) + page - 1) / page * page;
+
+    slab = mmap(NULL, pages + (size_t) count * config.page_size, PROT_READ | PROT_WRITE, 
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) {
+        perror("mapping slab");
+        exit(1);
+    }
+    slab->count = count;
+    slab->pages = pages;
+
+    // the lowest slot is taken first
+    for (int k = 0; k < config.channels; k++) {
+        for (int i = 0; i < config.banks; i++) {
+            slab->free[k * config.banks + i] = SLOT_BANK(k, config.banks - 1 - i);
+        }
+        slab->free_count[k] = config.banks;
+    }
+}
+
+void
+unmap_slab (void) {
+    munmap(slab, slab->pages + (size_t) slab->count * config.page_size);
+    slab = NULL;
+}
+
+// zeroed memory that lasts until the end of the run
+void *
+run_alloc (size_t size) {
+    void *block = calloc(1, size);
+    if (block == NULL) {
+        perror("allocating");
+        exit(3);
+    }
+
+    if (run_block_count == run_block_size) {
+        run_block_size = run_block_size == 0 ? 64 : run_block_size * 2;
+        run_blocks = realloc(run_blocks, run_block_size * sizeof (void *));
+    }
+    run_blocks[run_block_count++] = block;
+    return block;
+}
+
+void
+free_run (void) {
+    for (int i = 0; i < run_block_count; i++) {
+        free(run_blocks[i]);
+    }
+    free(run_blocks);
+    run_blocks = NULL;
+    run_block_count = 0;
+    run_block_size = 0;
+}
+
+char *
+slab_page (int slot) {
+    return (char *) slab + slab->pages + (size_t) slot * config.page_size;
+}
+
+// with -z, a free slot of the channel's for its io device to fill. 
+// only the channel's transfer device takes and gives back its slots, 
+// and it holds one per bank at most, so running out is a bug.
+int
+slab_take (int channel) {
+    if (slab->free_count[channel] == 0) {
+        printf("Slab has no free page\n");
+        exit(1);
+    }
+    return slab->free[channel * config.banks + --slab->free_count[channel]];
+}
+
+// the slot given back last is taken next, while it is still in cache
+void
+slab_give (int channel, int slot) {
+    slab->free[channel * config.banks + slab->free_count[channel]++] = slot;
+}
+
+void
+write_message (channel_t *ch, message_t msg) {
+    unsigned char buf[MSGSIZE_MAX];
+    convert_to_bytes(msg, buf);
+    write_bytes(ch, buf, config.msg_size);
+    counters->sent++;
+}
+
+// with -b, add the bytes to the frame being built for the channel,
+// otherwise write them out straight away
+void
+write_bytes (channel_t *ch, unsigned char *buf, int count) {
+    if (config.batch && count <= FRAME_SIZE) {
+        if (ch->out_length + count > FRAME_SIZE) 
+            flush_channel(ch);
+
+        memcpy(ch->out + ch->out_length, buf, count);
+        ch->out_length += count;
+        return;
+    }
+
+    // too big to queue, such as a large page: whatever is queued 
+    // has to go out first to keep the order
+    flush_channel(ch);
+    write_channel(ch, buf, count);
+}
+
+// send the frame queued on the channel with a single write
+void
+flush_channel (channel_t *ch) {
+    if (ch->out_length > 0) {
+        write_channel(ch, ch->out, ch->out_length);
+        ch->out_length = 0;
+    }
+}
+
+void
+write_channel (channel_t *ch, unsigned char *buf, int count) {
+    if (ch->ring != NULL) {
+        ring_write(ch->ring, buf, count);
+        return;
+    }
+
+    // a signal can cut a write short, and the rest still has to go:
+    // a message is never dropped
+    while (count > 0) {
+        int nwritten = write(ch->pipe[1], buf, count);
+        if (nwritten == -1) {
+            if (errno == EINTR || errno == EAGAIN) 
+                continue;
+            perror("sending message to pipe");
+            exit(4);
+        }
+        buf += nwritten;
+        count -= nwritten;
+    }
+}
+
+// prints the bits as they go on the wire
+void
+print_message (message_t msg) {
+    int data_bits = config.msg_size * 8 - 8;
+
+    for (int i = 31; i >= 24; i--) {
+        printf("%d", (msg >> i) & 1);
+    }
+    for (int i = data_bits - 1; i >= 0; i--) {
+        printf("%d", (msg >> i) & 1);
+    }
+}
+
+unsigned char 
+get_control (message_t msg) {
+    unsigned char c = msg >> 24;
+    return c;
+}
+
+unsigned int 
+get_data (message_t msg) {
+    return msg & 0xFFFFFF;
+}
+
+int
+get_id (message_t msg) {
+    int id = msg >> 24;
+    id = id & 0b00011111;
+    return id;
+}
+
+// true when msg is meant for device 'id', directly or by broadcast
+int
+addressed_to (message_t msg, int id) {
+    int to = get_id(msg);
+    return to == id || to == BROADCAST_ID;
+}
+
+int
+check_interrupt (message_t msg) {
+    return (msg & (1u << 31)) != 0;
+}
+
+int
+check_carry_data (message_t msg) {
+    return (msg & (1u << 30)) != 0;
+}
+
+int
+check_halt (message_t msg) {
+    return (msg & (1u << 29)) != 0;
+}
+
+// a message without any of the three flag bits starts a burst
+int
+check_burst (message_t msg) {
+    return msg != 0 && (msg & (0b111u << 29)) == 0;
+}
+
+// fills in what each control byte means to the device 'id'
+void
+classify (unsigned char classes[256], int id) {
+    for (int control = 0; control < 256; control++) {
+        message_t msg = (message_t) control << 24;
+
+        if (!addressed_to(msg, id)) 
+            classes[control] = CLASS_OTHER;
+        else if (check_halt(msg)) 
+            classes[control] = CLASS_HALT;
+        else if (check_interrupt(msg)) 
+            classes[control] = CLASS_INTERRUPT;
+        else if (check_carry_data(msg)) 
+            classes[control] = CLASS_DATA;
+        else 
+            classes[control] = CLASS_BURST;
+    }
+}
+
+// the same for the bus, which passes on everything except halts, 
+// bursts (passed on whole) and what its interrupt controller takes: 
+// interrupts for the cpu, and anything for the bus itself
+void
+classify_bus (unsigned char classes[256]) {
+    for (int control = 0; control < 256; control++) {
+        message_t msg = (message_t) control << 24;
+        int id = get_id(msg);
+
+        if (check_halt(msg)) 
+            classes[control] = CLASS_HALT;
+        else if (id == BUS_ID || (id == CPU_ID && check_interrupt(msg))) 
+            classes[control] = CLASS_CONTROLLER;
+        else if ((msg & (0b111u << 29)) == 0) 
+            classes[control] = CLASS_BURST;
+        else 
+            classes[control] = CLASS_ROUTE;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,52 @@
+#!/bin/sh
+# builds the simulation and checks its text against what each script
+# should produce. stops at the first case that differs.
+set -e
+cd "$(dirname "$0")/.."
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+gcc -O2 -pthread -o "$work/cpu_simulation" cpu_simulation.c
+sim="$work/cpu_simulation"
+
+fail () {
+    echo "FAIL: $1"
+    exit 1
+}
+
+# the sample script
+"$sim" -V file.txt 284 | cmp -s - output.txt || fail "file.txt"
+
+# a batch script longer than the number can count without -W
+mkdir "$work/out"
+awk 'BEGIN {
+    for (i = 0; i < 1000; i++) {
+        printf "t "
+        for (j = 0; j < 90; j++) 
+            printf "%c", 97 + (i + j) % 26
+        printf "\nn\n"
+    }
+}' > "$work/long.txt"
+awk '/^t / { printf "%s", substr($0, 3) } /^n$/ { printf "\n" }' "$work/long.txt" > "$work/long.expected"
+"$sim" -V batch "$work/out" "$work/long.txt" > /dev/null || fail "batch of a long script"
+cmp -s "$work/out/long.txt.out" "$work/long.expected" || fail "batch of a long script"
+
+# text holding an empty byte: the page ends there for the cpu, and
+# nothing written after it may show up in the next page
+printf 't AAAA\000BBBBBBBBBBB\nt CCCCCCC\nn\n' > "$work/empty_byte.txt"
+printf 'AAAACCCCCCC\n' > "$work/empty_byte.expected"
+for options in "-p 16" "-d -p 16" "-d -p 16 -B 3"; do
+    "$sim" -V $options "$work/empty_byte.txt" 24 | cmp -s - "$work/empty_byte.expected" \
+        || fail "empty byte with $options"
+done
+
+# a trace of two channels, each device replayed against its own channel
+"$sim" -V -d -n 2 -o "$work/channel" -T "$work/trace" file.txt "$work/long.txt" > /dev/null
+for channel in 0 1; do
+    for device in transfer buffer; do
+        "$sim" replay "$work/trace" $device 1 $channel > /dev/null || fail "replay of $device $channel"
+    done
+done
+
+echo "all passed"